@@ -5,6 +5,8 @@
  *
  * @author Connor Henley, @thatging3rkid
  */
+#define _XOPEN_SOURCE 700
+
 #include <math.h>
 #include <errno.h>
 #include <stdio.h>
@@ -12,296 +14,352 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ncurses.h>
+#include <sys/stat.h>
+
+#include "utils/scan.h"
+#include "utils/codec.h"
+#include "utils/config.h"
+#include "utils/file_contents.h"
+#include "utils/string_utils.h"
 
 #define FOOTER_HEIGHT 1
-#define PAGE_JUMP 60
 #define ARROW_JUMP 30
 #define STATUS_LEN 46
+#define READ_BLOCK (1 << 16)
+#define SCAN_BLOCK (1 << 20)
+#define INDEX_STRIDE 1024
+#define OSC52_LIMIT 100000
+#define SAVE_TICK 100 // milliseconds between footer updates while saving
+#define PREVIEW_BYTES (1 << 16)
+#define PROFILE_MAX 16
+
+/*
+ * A place the window can be cut at in a file opened in window mode
+ */
+typedef struct {
+    long offset;  // where the line starts
+    long line;    // the number of the line
+} IndexMark;
+
+/*
+ * A run of lines in a file opened in window mode. The lines are either in
+ * memory (the window, or an edited overlay), or a byte range of the original
+ * file or the spill file.
+ */
+typedef struct {
+    FILE * src;
+    long start;
+    long end;
+    int stride;  // the index mark the Segment starts at in the original file, -1 for the spill file
+    long lines;  // the number of newlines, -1 if the scan hasn't counted them yet
+    FileContents * fc;
+} Segment;
+
+typedef struct {
+    char * path;
+    FILE * fp;
+    long size;
+    FILE * spill;
+    long spill_len;
+    Segment * segs;
+    int seg_len;
+    int seg_cap;
+    int window;
+    size_t budget;
+    size_t overlay_bytes;
+
+    // The sparse line index, marking every INDEX_STRIDE'th line and at least every budget / 8 bytes
+    IndexMark * index;
+    int index_len;
+    int index_cap;
+    bool scan_done;
+    volatile bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    pthread_t scanner;
+} LargeFile;
 
+/*
+ * A save running on a background thread. The thread writes out a snapshot of
+ * the document, so editing can carry on while it works. It only reads the
+ * snapshot: the snapshot is taken and released on the main thread, so the
+ * line reference counts are never touched by two threads.
+ */
 typedef struct {
-    int x;
-    int y;
-} CursorPos;
+    FileContents * snap;
+    char * filename;
+    long edits;    // the number of edits made when the snapshot was taken
+    long written;  // the number of lines written so far (atomic)
+    bool done;     // set once the thread has finished (atomic)
+    int errsv;     // 0 if the save worked, otherwise the errno
+    pthread_t thread;
+} Saver;
 
+/*
+ * A file being scanned and read on a background thread, while the terminal
+ * gets set up and the first screen is drawn
+ */
 typedef struct {
-    char * data;
-    int len;
-} FileLine;
+    char * filepos;
+    CodecReader * reader;
+    bool scanned;        // whether scan was filled in
+    ScanResult scan;
+    FileContents * fc;   // NULL if the read failed
+    int errsv;
+    bool done;           // set once the thread has finished (atomic)
+    double scan_done;    // when each step finished (see elapsed_ms())
+    double read_done;
+    pthread_t thread;
+} Loader;
 
+/*
+ * Everything the editor loop keeps track of for the file being edited. It's
+ * handed to the function bound to each key.
+ */
 typedef struct {
-    FileLine ** data;
-    int len;
-} FileContents;
+    char * filepos;
+    FileContents * fc;
+    LargeFile * lf;
+    CursorPos pos;
+    int start_line;
+    CursorList cursors;
+    int primary;
+    bool marking;
+    CursorPos mark;
+    int tab_does;
+    Saver * saver;
+    bool save_again;
+    time_t last_save;
+
+    // About the key being handled
+    int input;
+    int old_len;      // the number of lines before the key was handled
+    int dirty_first;  // the only lines the key changed, or -1 to redraw everything
+    int dirty_last;
+    bool quit;
+} Editor;
 
 static unsigned char linenum_width = 1;
 static CursorPos max_pos = {.x = 1, .y = 1};
 static char status[STATUS_LEN];
 static bool error_status = false;
 static bool changed = false;
+static Codec file_codec = CODEC_NONE;
+static bool crlf_endings = false;
+static bool has_bom = false;
+static mode_t file_mask = 022; // the umask, for the permissions of new files
+static long line_base = 0;
+static bool window_dirty = false;
+static size_t window_budget = 0; // bytes
+static FileContents * clipboard = NULL;
+static FILE * replay = NULL;
+static bool replay_done = false; // set once the replay script has run out
+static long edits = 0;
+static int autosave = 0; // seconds between saves, 0 to only save on ctrl+s
+static Config config;
+static bool startup_profile = false;
+static struct timespec started;
+static struct {
+    char * phase;
+    double at;
+} profile[PROFILE_MAX];
+static int profile_len = 0;
 
 /*
  * Function prototypes
  */
-static FileContents * read_file(FILE * fp);
-static void fc_cleanup(FileContents * fc);
-static void fc_insert(FileContents * fc, int x, int y, char ins_char);
-static void fc_remove(FileContents * fc, int x, int y);
-static void fc_newline(FileContents * fc, int x, int y);
+static FileContents * read_file(CodecReader * reader, long lines_hint);
 static void clear_status();
 static void set_status(char * new_status);
 static void set_status_err(char * new_status);
 static void fileset_status(int errsv);
-static void draw_footer(char * filename, int x, int y, bool changed);
+static void draw_footer(char * filename, int x, long y, bool changed);
 static void draw_file(FileContents * fc, int text_start);
+static void draw_lines(FileContents * fc, int text_start, int first, int last);
 static void update_max();
 static bool at_eol(int x, int y, FileContents * fc);
 static bool at_bol(int x, int y, FileContents * fc);
-static void write_file(FileContents * fc, char * filename);
+static char * save_target(char * filename);
+static int open_save(char * target, char ** temp_name, bool in_place_ok);
+static int write_file(FileContents * fc, char * filename, long * progress);
+static FileContents * fc_snapshot(FileContents * fc);
+static void * save_run(void * arg);
+static Saver * save_start(FileContents * fc, char * filename);
+static bool save_poll(Saver * sv, bool wait);
+static void save_progress(Saver * sv);
+static void cl_push(CursorList * cl, CursorPos p);
+static int cl_normalize(CursorList * cl, int primary);
+static int cl_clear(CursorList * cl, CursorPos pos);
+static int cl_add_matches(CursorList * cl, FileContents * fc, char * needle);
+static int read_key();
+static bool prompt(char * label, char * buf, int size);
+static void draw_cursors(CursorList * cl, int primary, int text_start);
+static void osc52_copy(FileContents * clip);
+static void draw_selection(FileContents * fc, CursorPos start, CursorPos end, int text_start);
+static void mark_changed();
+static FileContents * split_lines(char * buf, long len);
+static FileContents * read_range(FILE * fp, long start, long end);
+static void * lf_scan(void * arg);
+static bool lf_stride(LargeFile * lf, int stride, IndexMark * mark);
+static size_t lf_cost(IndexMark from, IndexMark to);
+static void lf_insert_seg(LargeFile * lf, int i);
+static void lf_split(LargeFile * lf, int i, int stride, long offset);
+static int lf_spill(LargeFile * lf, Segment * seg);
+static bool lf_load(LargeFile * lf, int i);
+static void lf_unload(LargeFile * lf);
+static LargeFile * lf_open(char * path, long size, size_t budget);
+static bool lf_slide(LargeFile * lf, int dir);
+static FileContents * lf_window(LargeFile * lf);
+static void lf_save(LargeFile * lf, char * filename);
+static void lf_cleanup(LargeFile * lf);
+static double elapsed_ms();
+static void profile_mark(char * phase, double at);
+static void profile_print(char * filepos);
+static void * load_run(void * arg);
+static size_t file_cost(char * filepos, long size);
+static void draw_preview(char * filepos, char * filename, long size);
+static bool ed_slide(Editor * ed, int dir);
+static void ed_shift_cursors(Editor * ed, int dx);
+static void ed_copy(Editor * ed, bool cut);
+static void ed_remove(Editor * ed, bool before);
+static void act_insert(Editor * ed);
+static void act_left(Editor * ed);
+static void act_right(Editor * ed);
+static void act_up(Editor * ed);
+static void act_down(Editor * ed);
+static void act_page_up(Editor * ed);
+static void act_page_down(Editor * ed);
+static void act_cursor_up(Editor * ed);
+static void act_cursor_down(Editor * ed);
+static void act_escape(Editor * ed);
+static void act_find(Editor * ed);
+static void act_mark(Editor * ed);
+static void act_copy(Editor * ed);
+static void act_cut(Editor * ed);
+static void act_paste(Editor * ed);
+static void act_backspace(Editor * ed);
+static void act_delete(Editor * ed);
+static void act_newline(Editor * ed);
+static void act_tab(Editor * ed);
+static void act_save(Editor * ed);
+static void act_exit(Editor * ed);
+static void act_column(Editor * ed);
+
+/*
+ * What each Action does, indexed by Action (the key bindings are in config.keys)
+ */
+static void (* const actions[ACT_COUNT])(Editor * ed) = {
+    [ACT_NONE] = NULL, [ACT_INSERT] = act_insert, [ACT_LEFT] = act_left, [ACT_RIGHT] = act_right,
+    [ACT_UP] = act_up, [ACT_DOWN] = act_down, [ACT_PAGE_UP] = act_page_up, [ACT_PAGE_DOWN] = act_page_down,
+    [ACT_CURSOR_UP] = act_cursor_up, [ACT_CURSOR_DOWN] = act_cursor_down, [ACT_ESCAPE] = act_escape,
+    [ACT_FIND] = act_find, [ACT_MARK] = act_mark, [ACT_COPY] = act_copy, [ACT_CUT] = act_cut,
+    [ACT_PASTE] = act_paste, [ACT_BACKSPACE] = act_backspace, [ACT_DELETE] = act_delete,
+    [ACT_NEWLINE] = act_newline, [ACT_TAB] = act_tab, [ACT_SAVE] = act_save, [ACT_EXIT] = act_exit,
+    [ACT_COLUMN] = act_column
+};
 
 /**
- * Reads a file from a file pointer and makes the FileContents for it
+ * Reads a file from a (possibly compressed) stream and makes the FileContents for it
  *
- * @param fp file pointer to read from
- * @return a FileContents pointer
+ * The stream is read in blocks and split on newlines, so every line is
+ * allocated exactly once. Carriage returns are dropped from CRLF files, and
+ * put back by write_file().
+ *
+ * @param reader the stream to read from
+ * @param lines_hint how many lines the file has (from a scan), or 0 if unknown
+ * @return a FileContents pointer, or NULL with errno set if the file could not be read
  *
  * @note the returned object must be freed using fc_cleanup
  */
-static FileContents * read_file(FILE * fp) {
-    // Initalize stuff and go to the beginning of the file
-    fseek(fp, 0, SEEK_SET);
+static FileContents * read_file(CodecReader * reader, long lines_hint) {
     FileContents * output = malloc(sizeof(FileContents));
     output->data = NULL;
     output->len = 0;
+    int cap = 0;
 
-    // Loop through the file until an EOF is found
-    bool eof = false;
-    while (true) {
-        // For every line, make a FileLine
-        FileLine * entry = malloc(sizeof(FileLine));
-        entry->len = 1;
-        entry->data = malloc(sizeof(char));
-
-        // Read in every character, one-by-one
-        char input;
-        while (true) {
-            input = fgetc(fp);
-
-            // Check for EOF and newline
-            if (input == EOF) {
-                eof = true;
-                break;
-            } else {
-                entry->len += 1;
-                char * temp = realloc(entry->data, sizeof(char) * entry->len);
-                if (temp == NULL) {
+    // Size the line table up front when the scan has counted the lines
+    if (lines_hint > 0) {
+        output->data = malloc(sizeof(FileLine *) * lines_hint);
+        cap = (output->data == NULL) ? 0 : lines_hint;
+    }
+
+    // Characters of a line that was split across two blocks
+    char * partial = NULL;
+    int partial_len = 0;
+    int partial_cap = 0;
+
+    char * block = malloc(sizeof(char) * READ_BLOCK);
+    size_t got;
+    while ((got = codec_read(reader, block, READ_BLOCK)) > 0) {
+        char * cur = block;
+        char * end = block + got;
+
+        // Make a FileLine for every newline in the block
+        char * nl;
+        while ((nl = memchr(cur, '\n', end - cur)) != NULL) {
+            FileLine * entry = make_line(partial, partial_len, cur, nl - cur + 1);
+            if (crlf_endings && entry->len >= 3 && entry->data[entry->len - 3] == '\r') {
+                entry->data[entry->len - 3] = '\n';
+                entry->data[entry->len - 2] = '\0';
+                entry->len -= 1;
+            }
+            fc_append(output, &cap, entry);
+            partial_len = 0;
+            cur = nl + 1;
+        }
+
+        // Hold on to the rest until the next block
+        if (cur < end) {
+            if (partial_len + (end - cur) > partial_cap) {
+                partial_cap = (partial_len + (end - cur)) * 2;
+                partial = realloc(partial, partial_cap);
+                if (partial == NULL) {
                     fprintf(stderr, "delta: error allocating memory, exiting\n");
                     endwin();
                     exit(EXIT_FAILURE);
-                } else {
-                    entry->data = temp;
-                    entry->data[entry->len - 2] = input;
-                    entry->data[entry->len - 1] = '\0';
-                }
-                if (input == '\n') {
-                    break;
                 }
             }
+            memcpy(partial + partial_len, cur, end - cur);
+            partial_len += end - cur;
         }
-
-        // Make space for a new FileLine in the FileContents
-        if (output->len == 0) {
-            output->data = malloc(sizeof(FileLine *));
-        }
-        output->len += 1;
-        FileLine ** temp = realloc(output->data, sizeof(FileLine*) * output->len);
-        if (temp == NULL) {
-            fprintf(stderr, "delta: error allocating memory, exiting\n");
-            endwin();
-            exit(EXIT_FAILURE);
-        } else {
-            output->data = temp;
-            output->data[output->len - 1] = entry;
-        }
-
-        // Handle the EOF
-        if (eof) {
-            break;
-        }
-    }
-
-    // Return the complete FileContents
-    return output;
-}
-
-/**
- * Clean up a FileContents instance
- *
- * @param fc a pointer to the FileContents instance (given by read_file())
- */
-static void fc_cleanup(FileContents * fc) {
-    // Free all the FileLines and their data
-    for (int i = 0; i < fc->len; i += 1) {
-        free(fc->data[i]->data);
-        free(fc->data[i]);
-        fc->data[i] = NULL;
     }
 
-    // Free the FileContents instance
-    free(fc->data);
-    free(fc);
-    fc = NULL;
-}
-
-/**
- * Insert a character at a certain position
- *
- * @param fc a pointer to the FileContents instance
- * @param x the x coordinate of the position (aka column)
- * @param y the y coordinate of the position (aka row)
- * @param ins_char the character to insert
- */
-static void fc_insert(FileContents * fc, int x, int y, char ins_char) {
-    // Ensure the position is in-bounds
-    if (y < 0 || y > fc->len || x < 0 || x > fc->data[y]->len - 2) {
-        return;
-    }
+    // The last line never has a newline (and is empty if the file ends with one)
+    fc_append(output, &cap, make_line(partial, partial_len, NULL, 0));
+    free(partial);
+    free(block);
 
-    // Make the FileLine longer
-    fc->data[y]->len += 1;
-    char * temp = realloc(fc->data[y]->data, fc->data[y]->len);
-    if (temp == NULL) {
-        fprintf(stderr, "delta: an error has occured\n");
-        endwin();
-        exit(EXIT_FAILURE);
+    // Give back the extra room in the line table
+    if (cap != output->len) {
+        FileLine ** temp = realloc(output->data, sizeof(FileLine *) * output->len);
+        if (temp != NULL) {
+            output->data = temp;
+        }
     }
-    fc->data[y]->data = temp;
 
-    // Special case for an empty line
-    if (fc->data[y]->len == 3) {
-        fc->data[y]->data[0] = ins_char;
-        fc->data[y]->data[1] = '\n';
-        fc->data[y]->data[2] = '\0';
-        return;
+    // The byte order mark is put back by write_file()
+    FileLine * first = output->data[0];
+    if (has_bom && first->len >= 4 && memcmp(first->data, "\xef\xbb\xbf", 3) == 0) {
+        memmove(first->data, first->data + 3, first->len - 3);
+        first->len -= 3;
     }
 
-    // Start by copying all data after the insertion point into a temporary spot
-    char * temp_s = malloc(sizeof(char) * (fc->data[y]->len - x));
-    strncpy(temp_s, fc->data[y]->data + x, fc->data[y]->len - 1 - x);
-
-    // Then insert the character
-    fc->data[y]->data[x] = ins_char;
-
-    // Finally, copy the data back into the array, after the insertion point
-    // While this method may not be the fastest, it works.
-    strncpy(fc->data[y]->data + x + 1, temp_s, fc->data[y]->len - 1 - x);
-
-    // Cleanup memory used by the temporary storage
-    free(temp_s);
-}
-
-/**
- * Remove a character at a certain position
- *
- * @param fc a pointer to the FileContents instance
- * @param x the x coordinate of the position (aka column)
- * @param y the y coordinate of the position (aka row)
- */
-static void fc_remove(FileContents * fc, int x, int y) {
-    if (y < 0 || y > fc->len || x < 0 || x > fc->data[y]->len - 1) {
-        beep(); // for debugging right now, might become a feature
-        return;
+    if (codec_close_read(reader) == -1) {
+        int errsv = errno;
+        fc_cleanup(output);
+        errno = errsv;
+        return NULL;
     }
 
-    // See if this is on a newline character
-    if (x == fc->data[y]->len - 2) {
-        // Calculate the new length of the line
-        int new_len = fc->data[y]->len + fc->data[y + 1]->len - 2;
-
-        // Make the storage for the data bigger
-        char * temp = realloc(fc->data[y]->data, new_len);
-        if (temp == NULL) {
-            fprintf(stderr, "delta: an error has occured\n");
-            endwin();
-            exit(EXIT_FAILURE);
-        }
-        fc->data[y]->data = temp;
-
-        // Move the data into the old string
-        strncpy(fc->data[y]->data + fc->data[y]->len - 2, fc->data[y + 1]->data, fc->data[y + 1]->len);
-
-        // Free references to the old line
-        free(fc->data[y + 1]->data);
-        free(fc->data[y + 1]);
-
-        // Decrease the length
-        fc->len -= 1;
-
-        // Move everything up a line
-        for (int i = y + 1; i < fc->len - 1; i += 1) {
-            fc->data[i] = fc->data[i + 1];
-        }
-    } else {
-        // Make temorary space for the contents of the line
-        char * temp_s = malloc(sizeof(char) * fc->data[y]->len);
-        strncpy(temp_s, fc->data[y]->data, fc->data[y]->len);
-
-        // Move the space for the string and make it one shorter
-        fc->data[y]->len -= 1;
-        char * temp = realloc(fc->data[y]->data, fc->data[y]->len);
-        if (temp == NULL) {
-            fprintf(stderr, "delta: an error has occured\n");
-            endwin();
-            exit(EXIT_FAILURE);
-        }
-        fc->data[y]->data = temp;
-
-        // Move the data back into the string, overwriting the old character
-        x += 1;
-        strncpy(fc->data[y]->data, temp_s, x);
-        strncpy(fc->data[y]->data + x - 1, temp_s + x, fc->data[y]->len - x);
-
-        // Free the temporary resources
-        free(temp_s);
-    }
+    // Return the complete FileContents
+    return output;
 }
 
-/**
- * Make a new line
- *
- * @param fc a pointer to the FileContents instance
- * @param x the x coordinate of the position (aka column)
- * @param y the y coordinate of the position (aka row)
- */
-static void fc_newline(FileContents * fc, int x, int y) {
-    if (at_eol(x, y, fc)) {
-        // Make a new temporary storage area
-        FileLine ** temp_f = malloc(sizeof(FileLine *) * (fc->len - y));
-
-        // Fill the temporary storage
-        memcpy(temp_f, fc->data + (y * (sizeof(void *))), fc->len - y - 1);
-
-        // Make an empty new line
-        FileLine * temp_l = malloc(sizeof(FileLine));
-        temp_l->len = 2;
-        temp_l->data = malloc(sizeof(char) * 2);
-        temp_l->data[0] = '\n';
-        temp_l->data[1] = '\0';
-
-        // Fill in the new line
-        fc->data[y] = temp_l;
-        fc->len += 1;
-
-        // Move data back into the array
-        FileLine ** temp_d = realloc(fc->data, fc->len);
-        assert(temp_d != NULL);
-        fc->data = temp_l;
-        memcpy(fc->data + ((y + 1) * sizeof(FileLine *)), temp_f, fc->len - y - 2);
-
-        // Free up the temporary storage
-        free(temp_f);
-    }
-}
 
 /**
  * Empty the status bar
@@ -378,12 +436,15 @@ static void fileset_status(int errsv) {
     case EROFS:
         set_status_err("Read-only file system");
         break;
+    case EPIPE:
+        set_status_err("Broken pipe (zstd exited early)");
+        break;
     default: ;
         char temp_status[STATUS_LEN];
         for (int i = 0; i < STATUS_LEN; i += 1) {
             temp_status[i] = '\0';
         }
-        sprintf(temp_status, "Error %i, consult internet", errno);
+        sprintf(temp_status, "Error %i, consult internet", errsv);
         set_status_err(temp_status);
         break;
     }
@@ -394,10 +455,10 @@ static void fileset_status(int errsv) {
  *
  * @param filename the name of the file (not the location)
  * @param x the current x coordinate (aka column)
- * @param y the current y coordinate (aka row)
+ * @param y the current y coordinate (aka row), counted from the start of the file
  * @param changed if the file has been changed
  */
-static void draw_footer(char * filename, int x, int y, bool changed) {
+static void draw_footer(char * filename, int x, long y, bool changed) {
     // Turn on the black text with white background, make it bright
     attron(COLOR_PAIR(1) | A_BLINK);
 
@@ -410,7 +471,7 @@ static void draw_footer(char * filename, int x, int y, bool changed) {
     }
 
     // Next, write the filename, row, and column
-    printw("%s:%*d:%d        ", filename, linenum_width, y + 1, x + 1);
+    printw("%s:%*ld:%d        ", filename, linenum_width, y + 1, x + 1);
 
     // Move back a little to ensure the bar is always written
     move(max_pos.y - 1, linenum_width + 7 + strlen(filename));
@@ -483,16 +544,39 @@ static void draw_file(FileContents * fc, int text_start) {
     }
 
     // Update the width of the line numbers
-    linenum_width = log10(fc->len + 1) + 1;
+    linenum_width = log10(line_base + fc->len + 1) + 1;
 
     // Print data and line number
-    for (int i = text_start; i < text_end; i += 1) {
-        mvprintw(i - text_start, 0, "%*d%s", linenum_width, i + 1, fc->data[i]->data);
-    }
+    draw_lines(fc, text_start, text_start, text_end - 1);
     
     clrtobot();
 }
 
+/**
+ * Redraw some of the lines on the screen, leaving the rest alone
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param text_start the line the screen starts at
+ * @param first the first line to draw
+ * @param last the last line to draw
+ */
+static void draw_lines(FileContents * fc, int text_start, int first, int last) {
+    // Stay on the screen, and off the last line (like draw_file)
+    if (first < text_start) {
+        first = text_start;
+    }
+    if (last > text_start + max_pos.y - FOOTER_HEIGHT - 1) {
+        last = text_start + max_pos.y - FOOTER_HEIGHT - 1;
+    }
+    if (last > fc->len - 2) {
+        last = fc->len - 2;
+    }
+
+    for (int i = first; i <= last; i += 1) {
+        mvprintw(i - text_start, 0, "%*ld%s", linenum_width, line_base + i + 1, fc->data[i]->data);
+    }
+}
+
 /**
  * Ensure this is a valid position
  *
@@ -532,194 +616,1955 @@ static bool at_bol(int x, int y, FileContents * fc) {
     return (x == 0);
 }
 
-static void write_file(FileContents * fc, char * filename) {
-    FILE * fp = fopen(filename, "w");
-    if (fp == NULL) {
-        fileset_status(errno);
-        return;
+/**
+ * Work out which file a save really goes to
+ *
+ * @param filename the location given on the command line
+ * @return the file filename points at (through any symlinks), or filename if it doesn't exist yet
+ *
+ * @note the returned string must be freed
+ */
+static char * save_target(char * filename) {
+    char * target = realpath(filename, NULL);
+    if (target == NULL) {
+        target = malloc(strlen(filename) + 1);
+        if (target == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        strcpy(target, filename);
     }
+    return target;
+}
 
-    for (int i = 0; i < fc->len; i += 1) {
-        fwrite(fc->data[i]->data, sizeof(char), fc->data[i]->len - 1, fp);
+/**
+ * Open the file a save writes into
+ *
+ * Normally that's a new file next to the target, made with mkstemp() so nothing
+ * can be waiting there for it, and given the target's owner, group and
+ * permissions before anything is written to it. A file with other hard links,
+ * or with an owner or group the new file can't be given, is written over in
+ * place instead, if in_place_ok allows it.
+ *
+ * @param target the file being saved (given by save_target())
+ * @param temp_name set to the new file to rename over target, or NULL when writing into target itself
+ * @param in_place_ok if target can be written over in place
+ * @return the fd to write into, or -1 with errno set
+ *
+ * @note temp_name must be freed if it isn't NULL
+ */
+static int open_save(char * target, char ** temp_name, bool in_place_ok) {
+    struct stat info;
+    bool exists = (stat(target, &info) == 0);
+    *temp_name = NULL;
+
+    // Swapping in a new file would split it off from its other links
+    if (exists && info.st_nlink > 1 && in_place_ok) {
+        return open(target, O_WRONLY | O_TRUNC);
     }
 
-    fclose(fp);
-    set_status("Successfully wrote file");
-    changed = false;
-}
-
-static int edit_file(char * filepos) {
-    FILE * fp = fopen(filepos, "r");
-    if (fp == NULL) {
-        perror("delta");
+    char * name = malloc(strlen(target) + 8);
+    if (name == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
         endwin();
-        return EXIT_FAILURE;
+        exit(EXIT_FAILURE);
     }
-
-    initscr(); // Initalize ncurses
-    raw();     // Get raw input
-    noecho();  // Don't echo characters to the terminal
-    keypad(stdscr, TRUE); // Enable reading of all keys
-
-    // Make the color pairs
-    start_color();
-    init_pair(1, COLOR_BLACK, COLOR_WHITE); // Header color
-    init_pair(2, COLOR_BLACK, COLOR_CYAN);  // Status bar color
-    init_pair(3, COLOR_RED, COLOR_CYAN);    // Status bar error color
-
-    // Initalize more things
-    FileContents * fc = read_file(fp);
-    fclose(fp);
-    update_max();
-    
-    int input;
-    int start_line = 0;
-    changed = false;
-    int tab_does = 4; // will be read from a config file in later revisions
-
-    // Remove the path from the file location
-    char * filename = NULL;
-    if ((filename = strchr(filepos, '/')) != NULL) {
-        filename += 1;
-    } else {
-        filename = filepos;
+    sprintf(name, "%s.XXXXXX", target);
+    int fd = mkstemp(name);
+    if (fd == -1) {
+        free(name);
+        return -1;
     }
 
-    // Even more initalization
-    CursorPos pos = {.x = 0, .y = 0};
-    draw_file(fc, 0);
-    draw_footer(filename, pos.x, pos.y, changed);
-    move(pos.y, pos.x + linenum_width);
-    refresh();
-    
-    // The editor loop. Reads input, processes, writes the result and does it again.
-    while (true) {
-        // Read input from the keyboard
-        input = getch();
-
-        // Check for movement keys (left, right, etc.)
-        if (input == KEY_LEFT && at_bol(pos.x, pos.y, fc)) {
-            if (valid_move(0, pos.y - 1, fc)) {
-                pos.y -= 1;
-                pos.x = (fc->data[pos.y]->len - 2);
-            }
-        } else if (input == KEY_RIGHT && at_eol(pos.x, pos.y, fc)) {
-            if (valid_move(0, pos.y + 1, fc)) {
-                pos.x = 0;
-                pos.y += 1;
-            }
-        } else {
-            if (input == KEY_UP && valid_move(pos.x, pos.y - 1, fc)) {
-                pos.y -= 1;
-            } else if (input == KEY_DOWN && valid_move(pos.x, pos.y + 1, fc)) {
-                pos.y += 1;
-            }
-            if (input == KEY_LEFT  && valid_move(pos.x - 1, pos.y, fc)) {
-                pos.x -= 1;
-            } else if (input == KEY_RIGHT && valid_move(pos.x + 1, pos.y, fc)) {
-                pos.x += 1;
-            }
-        }
-
-        // Process a page up or page down
-        if (input == KEY_NPAGE) {
-            if (fc->len > pos.y + start_line + PAGE_JUMP) {
-                pos.y += PAGE_JUMP;
-                start_line += PAGE_JUMP;
-
-                refresh();
-            }
-        } else if (input == KEY_PPAGE) {
-            if (0 <= pos.y + start_line - PAGE_JUMP) {
-                pos.y -= PAGE_JUMP;
-                start_line -= PAGE_JUMP;
+    // Only root can give a file away, so write over the original instead
+    if (exists && fchown(fd, info.st_uid, info.st_gid) == -1 && in_place_ok) {
+        close(fd);
+        remove(name);
+        free(name);
+        return open(target, O_WRONLY | O_TRUNC);
+    }
+    fchmod(fd, exists ? (info.st_mode & 07777) : (0666 & ~file_mask));
 
-                refresh();
-            }
-        }        
+    *temp_name = name;
+    return fd;
+}
 
-        // Process a character input
-        if (32 <= input && input <= 126) {
-            fc_insert(fc, pos.x, pos.y, (char) input);
-            pos.x += 1;
-            changed = true;
+/**
+ * Write a FileContents back to disk, the same way it was read (compression,
+ * line endings and byte order mark)
+ *
+ * The file is written next to the original and swapped in once everything is
+ * there, so a failed save never leaves half a file behind. Symlinks are
+ * followed, so the link stays a link. See open_save() for when the file is
+ * written over in place instead.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param filename the location to write to
+ * @param progress set to the number of lines written so far as the write goes (may be NULL)
+ * @return 0 on success, otherwise -1 with errno set
+ *
+ * @note only uses fc and the file's layout, so it's safe to call from a background thread
+ */
+static int write_file(FileContents * fc, char * filename, long * progress) {
+    char * target = save_target(filename);
+    char * temp_name;
+    int fd = open_save(target, &temp_name, true);
+    int result = (fd == -1) ? -1 : fc_write(fc, fd, file_codec, has_bom, crlf_endings, progress);
+    int errsv = errno;
+
+    if (temp_name != NULL) {
+        if (result == 0 && rename(temp_name, target) == -1) {
+            result = -1;
+            errsv = errno;
         }
-
-        // Process a backspace
-        if (input == KEY_BACKSPACE) {
-            if (pos.x >= 1) {
-                changed = true;
-                pos.x -= 1;
-                fc_remove(fc, pos.x, pos.y);
-            }
+        if (result == -1) {
+            remove(temp_name);
         }
+        free(temp_name);
+    }
+    free(target);
+    errno = errsv;
+    return result;
+}
 
-        // Process a delete key
-        if (input == KEY_DC) {
-            changed = true;
-            fc_remove(fc, pos.x, pos.y);
-        }
+/**
+ * Take a snapshot of a FileContents, sharing all of its lines
+ *
+ * Edits copy a shared line before changing it, so the snapshot stays the way
+ * it was no matter what happens to fc afterwards.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @return a FileContents with the same lines as fc
+ *
+ * @note the returned object must be freed using fc_cleanup
+ */
+static FileContents * fc_snapshot(FileContents * fc) {
+    FileContents * snap = malloc(sizeof(FileContents));
+    FileLine ** data = malloc(sizeof(FileLine *) * fc->len);
+    if (snap == NULL || data == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
 
-        // Process an enter key
-        if (input == '\n') {
-            changed = true;
-            fc_newline(fc, pos.x, pos.y);
-        }
+    for (int i = 0; i < fc->len; i += 1) {
+        data[i] = fl_share(fc->data[i]);
+    }
+    snap->data = data;
+    snap->len = fc->len;
+    return snap;
+}
 
-        // Process a tab
-        if (input == '\t') {
-            if (tab_does == -1) {
-                fc_insert(fc, pos.x, pos.y, '\t');
-                pos.x += 6;
-            } else {
-                for (int i = 0; i < tab_does; i += 1) {
-                    fc_insert(fc, pos.x, pos.y, ' ');
-                    pos.x += 1;
-                }
-            }
-        }
-        
-        // Process a ctrl+s (save)
-        if (input == 19) {
-            if (changed) {   
-                write_file(fc, filename);
-            }
-        }
+/**
+ * Write out a save's snapshot (the body of the save thread)
+ *
+ * @param arg a pointer to the Saver
+ */
+static void * save_run(void * arg) {
+    Saver * sv = arg;
+    sv->errsv = (write_file(sv->snap, sv->filename, &sv->written) == 0) ? 0 : errno;
+    __atomic_store_n(&sv->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-        // Process a ctrl+e (exit)
-        if (input == 5) {
-            break;
-        }
+/**
+ * Start saving a FileContents in the background
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param filename the location to write to
+ * @return a pointer to the Saver, to be checked on with save_poll()
+ */
+static Saver * save_start(FileContents * fc, char * filename) {
+    Saver * sv = malloc(sizeof(Saver));
+    if (sv == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    sv->snap = fc_snapshot(fc);
+    sv->filename = filename;
+    sv->edits = edits;
+    sv->written = 0;
+    sv->done = false;
+    sv->errsv = 0;
+
+    // Without a thread, just save right here
+    if (pthread_create(&sv->thread, NULL, save_run, sv) != 0) {
+        save_run(sv);
+        sv->thread = pthread_self();
+    }
+    return sv;
+}
 
-        // Draw the updated file to the screen
-        draw_file(fc, start_line);
-        draw_footer(filename, pos.x, pos.y, changed);
-        move(pos.y - start_line, pos.x + linenum_width);       
-        update_max();
-        refresh();
+/**
+ * Check if a background save has finished, and report how it went if it has
+ *
+ * @param sv a pointer to the Saver (given by save_start())
+ * @param wait true to wait for the save to finish
+ * @return true if the save is over, in which case sv has been freed
+ */
+static bool save_poll(Saver * sv, bool wait) {
+    if (!wait && !__atomic_load_n(&sv->done, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    if (!pthread_equal(sv->thread, pthread_self())) {
+        pthread_join(sv->thread, NULL);
     }
 
-    fc_cleanup(fc);
-    endwin();
-    return EXIT_SUCCESS;
+    if (sv->errsv == 0) {
+        set_status("Successfully wrote file");
+        // Anything typed while the save was going still needs saving
+        changed = (edits != sv->edits);
+    } else {
+        fileset_status(sv->errsv);
+    }
+
+    fc_cleanup(sv->snap);
+    free(sv);
+    return true;
 }
 
 /**
- * The main function
+ * Show how far along a background save is in the footer
  *
- * @param argc the number of command-line arguments
- * @param argv a pointer to the command-line arguments
+ * @param sv a pointer to the Saver (given by save_start())
  */
-int main(int argc, char * argv[]) {
-    if (argc == 1) {
-        return EXIT_FAILURE; // Replace with some sort of tutorial/splash page
+static void save_progress(Saver * sv) {
+    // Don't cover up anything else that's being said
+    if (status[0] != '\0') {
+        return;
     }
-    
+
+    long written = __atomic_load_n(&sv->written, __ATOMIC_RELAXED);
+    char temp_status[STATUS_LEN];
+    snprintf(temp_status, STATUS_LEN, "Saving... %ld%%", written * 100 / sv->snap->len);
+    set_status(temp_status);
+}
+
+/**
+ * Add a cursor onto the end of a CursorList
+ *
+ * @param cl a pointer to the CursorList instance
+ * @param p the position of the new cursor
+ */
+static void cl_push(CursorList * cl, CursorPos p) {
+    if (cl->len == cl->cap) {
+        cl->cap *= 2;
+        CursorPos * temp = realloc(cl->data, sizeof(CursorPos) * cl->cap);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        cl->data = temp;
+    }
+    cl->data[cl->len] = p;
+    cl->len += 1;
+}
+
+/**
+ * Sort the cursors and merge any that ended up in the same place
+ *
+ * @param cl a pointer to the CursorList instance
+ * @param primary the index of the cursor the screen follows
+ * @return the new index of that cursor
+ */
+static int cl_normalize(CursorList * cl, int primary) {
+    CursorPos main = cl->data[primary];
+    qsort(cl->data, cl->len, sizeof(CursorPos), cursor_cmp);
+
+    int out = 0;
+    for (int i = 0; i < cl->len; i += 1) {
+        if (out == 0 || cursor_cmp(&cl->data[out - 1], &cl->data[i]) != 0) {
+            cl->data[out] = cl->data[i];
+            out += 1;
+        }
+    }
+    cl->len = out;
+
+    CursorPos * found = bsearch(&main, cl->data, cl->len, sizeof(CursorPos), cursor_cmp);
+    return found - cl->data;
+}
+
+/**
+ * Drop every cursor but the main one
+ *
+ * @param cl a pointer to the CursorList instance
+ * @param pos the position of the main cursor
+ * @return the index of the main cursor (always 0)
+ */
+static int cl_clear(CursorList * cl, CursorPos pos) {
+    cl->data[0] = pos;
+    cl->len = 1;
+    return 0;
+}
+
+/**
+ * Put a cursor at the start of every match of a string
+ *
+ * @param cl a pointer to the CursorList instance
+ * @param fc a pointer to the FileContents instance
+ * @param needle the string to look for
+ * @return the number of matches
+ */
+static int cl_add_matches(CursorList * cl, FileContents * fc, char * needle) {
+    int found = 0;
+    int needle_len = strlen(needle);
+    if (needle_len == 0) {
+        return 0;
+    }
+
+    for (int y = 0; y < fc->len; y += 1) {
+        char * hit = fc->data[y]->data;
+        while ((hit = strstr(hit, needle)) != NULL) {
+            cl_push(cl, (CursorPos) {.x = hit - fc->data[y]->data, .y = y});
+            found += 1;
+            hit += needle_len;
+        }
+    }
+    return found;
+}
+
+/**
+ * Read the next key, either from the keyboard or from the replay script
+ *
+ * A replay script has one command per line: "type <text>" types the text,
+ * "key <name> [count]" presses a key, and lines starting with # are ignored.
+ * Once the script runs out, any prompt is cancelled and the editor exits.
+ *
+ * @return the key code
+ */
+static int read_key() {
+    if (replay == NULL) {
+        return getch();
+    }
+
+    static char line[256];
+    static char * typing = NULL;
+    static int repeat_key = 0;
+    static int repeat_left = 0;
+
+    while (true) {
+        if (typing != NULL && *typing != '\0' && *typing != '\n') {
+            typing += 1;
+            return typing[-1];
+        }
+        if (repeat_left > 0) {
+            repeat_left -= 1;
+            return repeat_key;
+        }
+
+        // Move on to the next command in the script
+        typing = NULL;
+        if (fgets(line, sizeof(line), replay) == NULL) {
+            replay_done = true;
+            return 5;
+        }
+
+        char name[32];
+        int count = 1;
+        if (strncmp(line, "type ", 5) == 0) {
+            typing = line + 5;
+        } else if (sscanf(line, "key %31s %d", name, &count) >= 1 && config_key(name) != -1) {
+            repeat_key = config_key(name);
+            repeat_left = count;
+        } else if (line[0] != '#' && line[0] != '\n') {
+            fprintf(stderr, "delta: unknown replay command: %s", line);
+        }
+    }
+}
+
+/**
+ * Ask for a line of text in the footer
+ *
+ * @param label the text to show before the input
+ * @param buf where to put the text (nul-terminated)
+ * @param size the size of buf
+ * @return true if the text was entered, false if escape was pressed (or the replay script ran out)
+ */
+static bool prompt(char * label, char * buf, int size) {
+    int len = 0;
+    buf[0] = '\0';
+
+    while (true) {
+        attron(COLOR_PAIR(2) | A_BLINK);
+        mvprintw(max_pos.y - 1, 0, "%s%s", label, buf);
+        for (int i = strlen(label) + len; i < max_pos.x; i += 1) {
+            printw(" ");
+        }
+        attroff(COLOR_PAIR(2) | A_BLINK);
+        move(max_pos.y - 1, strlen(label) + len);
+        refresh();
+
+        int input = read_key();
+        if (input == '\n') {
+            return true;
+        } else if (input == 27 || replay_done) {
+            return false;
+        } else if ((input == KEY_BACKSPACE || input == 127) && len > 0) {
+            len -= 1;
+            buf[len] = '\0';
+        } else if (32 <= input && input <= 126 && len < size - 1) {
+            buf[len] = (char) input;
+            len += 1;
+            buf[len] = '\0';
+        }
+    }
+}
+
+/**
+ * Show the extra cursors on the screen
+ *
+ * @param cl a pointer to the CursorList instance
+ * @param primary the index of the main cursor (the terminal shows that one)
+ * @param text_start the line the screen starts at
+ */
+static void draw_cursors(CursorList * cl, int primary, int text_start) {
+    for (int i = 0; i < cl->len; i += 1) {
+        int row = cl->data[i].y - text_start;
+        if (i != primary && row >= 0 && row < max_pos.y - FOOTER_HEIGHT) {
+            mvchgat(row, cl->data[i].x + linenum_width, 1, A_REVERSE, 0, NULL);
+        }
+    }
+}
+
+/**
+ * Send copied text to the terminal's clipboard with an OSC 52 escape sequence
+ *
+ * @param clip the copied region
+ */
+static void osc52_copy(FileContents * clip) {
+    int len = 0;
+    for (int i = 0; i < clip->len; i += 1) {
+        len += clip->data[i]->len - 1;
+        if (len > OSC52_LIMIT) {
+            return; // most terminals ignore anything this big anyway
+        }
+    }
+
+    char * text = malloc(sizeof(char) * (len + 1));
+    int at = 0;
+    for (int i = 0; i < clip->len; i += 1) {
+        memcpy(text + at, clip->data[i]->data, clip->data[i]->len - 1);
+        at += clip->data[i]->len - 1;
+    }
+
+    char * encoded = str_base64(text, len);
+    printf("\033]52;c;%s\a", encoded);
+    fflush(stdout);
+    free(encoded);
+    free(text);
+}
+
+/**
+ * Highlight the selected region on the screen
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param start the first position of the region
+ * @param end the position just after the region
+ * @param text_start the line the screen starts at
+ */
+static void draw_selection(FileContents * fc, CursorPos start, CursorPos end, int text_start) {
+    for (int y = start.y; y <= end.y; y += 1) {
+        int row = y - text_start;
+        if (row < 0 || row >= max_pos.y - FOOTER_HEIGHT) {
+            continue;
+        }
+        int from = (y == start.y) ? start.x : 0;
+        int to = (y == end.y) ? end.x : fc->data[y]->len - 1;
+        if (to > from) {
+            mvchgat(row, from + linenum_width, to - from, A_REVERSE, 0, NULL);
+        }
+    }
+}
+
+/**
+ * Mark the document as changed
+ */
+static void mark_changed() {
+    changed = true;
+    edits += 1;
+    window_dirty = true;
+}
+
+/**
+ * Make the FileContents for a run of characters
+ *
+ * @param buf the characters
+ * @param len the number of characters
+ * @return a FileContents pointer
+ *
+ * @note like read_file(), the last line is whatever follows the final newline
+ */
+static FileContents * split_lines(char * buf, long len) {
+    FileContents * output = malloc(sizeof(FileContents));
+    output->data = NULL;
+    output->len = 0;
+    int cap = 0;
+
+    char * cur = buf;
+    char * nl;
+    while ((nl = memchr(cur, '\n', buf + len - cur)) != NULL) {
+        fc_append(output, &cap, make_line(NULL, 0, cur, nl - cur + 1));
+        cur = nl + 1;
+    }
+    fc_append(output, &cap, make_line(NULL, 0, cur, buf + len - cur));
+    return output;
+}
+
+/**
+ * Make the FileContents for a byte range of a file
+ *
+ * @param fp the file to read from
+ * @param start the offset of the first byte
+ * @param end the offset after the last byte
+ * @return a FileContents pointer, or NULL with errno set if the range could not be read
+ *
+ * @note like read_file(), the last line is whatever follows the final newline
+ */
+static FileContents * read_range(FILE * fp, long start, long end) {
+    char * buf = malloc(sizeof(char) * (end - start + 1));
+    if (buf == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    if (fseek(fp, start, SEEK_SET) == -1 ||
+        fread(buf, sizeof(char), end - start, fp) != (size_t) (end - start)) {
+        int errsv = ferror(fp) ? EIO : errno;
+        free(buf);
+        errno = errsv;
+        return NULL;
+    }
+
+    FileContents * output = split_lines(buf, end - start);
+    free(buf);
+    return output;
+}
+
+/**
+ * Scans a large file in the background, building the sparse line index
+ *
+ * @param arg a pointer to the LargeFile instance
+ */
+static void * lf_scan(void * arg) {
+    LargeFile * lf = arg;
+    FILE * fp = fopen(lf->path, "rb");
+    char * block = malloc(sizeof(char) * SCAN_BLOCK);
+    long offset = 0;
+    long lines = 0;
+    long marked = 0; // the offset of the last index mark
+
+    size_t got;
+    while (fp != NULL && !lf->stop && (got = fread(block, sizeof(char), SCAN_BLOCK, fp)) > 0) {
+        char * cur = block;
+        char * end = block + got;
+        char * nl;
+        while ((nl = memchr(cur, '\n', end - cur)) != NULL) {
+            lines += 1;
+            cur = nl + 1;
+
+            // Record where every INDEX_STRIDE'th line starts, and where the lines get long
+            long at = offset + (cur - block);
+            if (lines % INDEX_STRIDE == 0 || (size_t) (at - marked) >= lf->budget / 8) {
+                pthread_mutex_lock(&lf->lock);
+                if (lf->index_len == lf->index_cap) {
+                    lf->index_cap *= 2;
+                    lf->index = realloc(lf->index, sizeof(IndexMark) * lf->index_cap);
+                    if (lf->index == NULL) {
+                        fprintf(stderr, "delta: error allocating memory, exiting\n");
+                        endwin();
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                lf->index[lf->index_len] = (IndexMark) {.offset = at, .line = lines};
+                lf->index_len += 1;
+                marked = at;
+                pthread_cond_broadcast(&lf->progress);
+                pthread_mutex_unlock(&lf->lock);
+            }
+        }
+        offset += got;
+    }
+
+    pthread_mutex_lock(&lf->lock);
+    lf->scan_done = true;
+    pthread_cond_broadcast(&lf->progress);
+    pthread_mutex_unlock(&lf->lock);
+
+    free(block);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return NULL;
+}
+
+/**
+ * Find where an index mark is, waiting on the scan if it hasn't got there yet
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param stride which index mark to look up
+ * @param mark set to the mark
+ * @return false if the file doesn't have that many index marks
+ */
+static bool lf_stride(LargeFile * lf, int stride, IndexMark * mark) {
+    pthread_mutex_lock(&lf->lock);
+    while (stride >= lf->index_len && !lf->scan_done) {
+        pthread_cond_wait(&lf->progress, &lf->lock);
+    }
+    bool found = (stride < lf->index_len);
+    if (found) {
+        *mark = lf->index[stride];
+    }
+    pthread_mutex_unlock(&lf->lock);
+    return found;
+}
+
+/**
+ * Work out how much memory the lines between two index marks take up once they're read in
+ *
+ * @param from the earlier mark
+ * @param to the later mark
+ * @return the approximate number of bytes
+ */
+static size_t lf_cost(IndexMark from, IndexMark to) {
+    return (to.offset - from.offset) + (to.line - from.line) * fl_bytes(1);
+}
+
+/**
+ * Make room for a new Segment, moving everything after it down
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param i where the new Segment goes
+ */
+static void lf_insert_seg(LargeFile * lf, int i) {
+    if (lf->seg_len == lf->seg_cap) {
+        lf->seg_cap *= 2;
+        Segment * temp = realloc(lf->segs, sizeof(Segment) * lf->seg_cap);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        lf->segs = temp;
+    }
+    memmove(lf->segs + i + 1, lf->segs + i, sizeof(Segment) * (lf->seg_len - i));
+    lf->seg_len += 1;
+}
+
+/**
+ * Split a Segment of the original file at an index mark
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param i which Segment to split
+ * @param stride the index mark the second half starts at
+ * @param offset where that mark is
+ */
+static void lf_split(LargeFile * lf, int i, int stride, long offset) {
+    lf_insert_seg(lf, i + 1);
+    Segment * first = &lf->segs[i];
+    Segment * second = &lf->segs[i + 1];
+
+    *second = *first;
+    second->start = offset;
+    second->stride = stride;
+    first->end = offset;
+    pthread_mutex_lock(&lf->lock);
+    first->lines = lf->index[stride].line - lf->index[first->stride].line;
+    pthread_mutex_unlock(&lf->lock);
+    if (second->lines != -1) {
+        second->lines -= first->lines;
+    }
+}
+
+/**
+ * Move the lines of a Segment into the spill file so they no longer take up memory
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param seg the in-memory Segment to spill
+ * @return 0 on success, otherwise -1 with errno set
+ */
+static int lf_spill(LargeFile * lf, Segment * seg) {
+    if (lf->spill == NULL && (lf->spill = tmpfile()) == NULL) {
+        return -1;
+    }
+
+    fseek(lf->spill, lf->spill_len, SEEK_SET);
+    long start = lf->spill_len;
+    for (int i = 0; i < seg->fc->len; i += 1) {
+        if (fwrite(seg->fc->data[i]->data, sizeof(char), seg->fc->data[i]->len - 1, lf->spill)
+            != (size_t) (seg->fc->data[i]->len - 1)) {
+            return -1;
+        }
+        lf->spill_len += seg->fc->data[i]->len - 1;
+    }
+
+    lf->overlay_bytes -= fc_bytes(seg->fc);
+    seg->src = lf->spill;
+    seg->start = start;
+    seg->end = lf->spill_len;
+    seg->stride = -1;
+    fc_cleanup(seg->fc);
+    seg->fc = NULL;
+    return 0;
+}
+
+/**
+ * Load a Segment's lines and make it the window
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param i which Segment to load
+ * @return false with errno set if the lines could not be read
+ */
+static bool lf_load(LargeFile * lf, int i) {
+    Segment * seg = &lf->segs[i];
+    if (seg->fc != NULL) {
+        // Edited before, and still in memory
+        lf->overlay_bytes -= fc_bytes(seg->fc);
+    } else if ((seg->fc = read_range(seg->src, seg->start, seg->end)) == NULL) {
+        return false;
+    }
+
+    lf->window = i;
+    window_dirty = false;
+
+    // Work out the number of the first line in the window
+    line_base = 0;
+    for (int j = 0; j < i; j += 1) {
+        line_base += lf->segs[j].lines;
+    }
+    return true;
+}
+
+/**
+ * Stop editing the window, keeping its lines around as an overlay if they were changed
+ *
+ * @param lf a pointer to the LargeFile instance
+ */
+static void lf_unload(LargeFile * lf) {
+    Segment * seg = &lf->segs[lf->window];
+    if (!window_dirty) {
+        // Nothing changed, the lines can be read again from disk
+        fc_cleanup(seg->fc);
+        seg->fc = NULL;
+        return;
+    }
+
+    // Every Segment but the last has to end with a newline
+    FileLine * last = fc_own(seg->fc, seg->fc->len - 1);
+    if (lf->window != lf->seg_len - 1 && last->len > 1) {
+        char * temp = realloc(last->data, last->len + 1);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        last->data = temp;
+        last->data[last->len - 1] = '\n';
+        last->data[last->len] = '\0';
+        last->len += 1;
+
+        int cap = seg->fc->len;
+        fc_append(seg->fc, &cap, make_line(NULL, 0, NULL, 0));
+    }
+    seg->lines = seg->fc->len - 1;
+    lf->overlay_bytes += fc_bytes(seg->fc);
+
+    // Keep the overlays within their half of the budget
+    for (int i = 0; i < lf->seg_len && lf->overlay_bytes > lf->budget / 2; i += 1) {
+        if (i != lf->window && lf->segs[i].fc != NULL && lf_spill(lf, &lf->segs[i]) == -1) {
+            fileset_status(errno);
+            return;
+        }
+    }
+    if (lf->overlay_bytes > lf->budget / 2 && lf_spill(lf, seg) == -1) {
+        fileset_status(errno);
+    }
+}
+
+/**
+ * Open a file in window mode, starting the line index scan and loading the first window
+ *
+ * @param path the location of the file
+ * @param size the size of the file in bytes
+ * @param budget the number of bytes the document may keep in memory
+ * @return a LargeFile pointer, or NULL with errno set if the file could not be opened
+ *
+ * @note the returned object must be freed using lf_cleanup
+ */
+static LargeFile * lf_open(char * path, long size, size_t budget) {
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    LargeFile * lf = malloc(sizeof(LargeFile));
+    lf->path = path;
+    lf->fp = fp;
+    lf->size = size;
+    lf->spill = NULL;
+    lf->spill_len = 0;
+    lf->budget = budget;
+    lf->overlay_bytes = 0;
+    lf->index_cap = 1024;
+    lf->index = malloc(sizeof(IndexMark) * lf->index_cap);
+    lf->index[0] = (IndexMark) {.offset = 0, .line = 0};
+    lf->index_len = 1;
+    lf->scan_done = false;
+    lf->stop = false;
+    pthread_mutex_init(&lf->lock, NULL);
+    pthread_cond_init(&lf->progress, NULL);
+
+    // To start with, the whole document is just the file on disk
+    lf->seg_cap = 16;
+    lf->segs = malloc(sizeof(Segment) * lf->seg_cap);
+    lf->seg_len = 1;
+    lf->segs[0] = (Segment) {.src = fp, .start = 0, .end = size, .stride = 0, .lines = -1, .fc = NULL};
+
+    if (pthread_create(&lf->scanner, NULL, lf_scan, lf) != 0) {
+        // Fall back on scanning in the foreground
+        lf_scan(lf);
+        lf->scanner = pthread_self();
+    }
+
+    lf->window = 0;
+    if (!lf_slide(lf, 0)) {
+        int errsv = errno;
+        lf_cleanup(lf);
+        errno = errsv;
+        return NULL;
+    }
+    return lf;
+}
+
+/**
+ * Move the window to the next or previous part of the file
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param dir 1 to move down, -1 to move up, 0 to load the first window
+ * @return false if there is nothing more in that direction, or the lines could not be read
+ */
+static bool lf_slide(LargeFile * lf, int dir) {
+    int next = lf->window + dir;
+    if (next < 0 || next >= lf->seg_len) {
+        return false;
+    }
+    if (dir != 0) {
+        lf_unload(lf);
+    }
+
+    // Only take a window's worth out of the original file. A window is sized by the
+    // memory its lines take up, which is a lot more than the file for short lines.
+    Segment * seg = &lf->segs[next];
+    size_t target = lf->budget / 4;
+    IndexMark first;
+    if (seg->fc == NULL && seg->src == lf->fp && lf_stride(lf, seg->stride, &first)) {
+        IndexMark mark;
+        if (dir >= 0) {
+            // Take index marks off the front until there is enough
+            int stride = seg->stride + 1;
+            while (lf_stride(lf, stride, &mark) && mark.offset < seg->end) {
+                if (lf_cost(first, mark) >= target) {
+                    lf_split(lf, next, stride, mark.offset);
+                    break;
+                }
+                stride += 1;
+            }
+        } else {
+            // Find the index mark at the end of the Segment, then take marks off the back until there is enough
+            int last = seg->stride + 1;
+            IndexMark end = first;
+            while (lf_stride(lf, last, &mark) && mark.offset < seg->end) {
+                end = mark;
+                last += 1;
+            }
+            if (lf_stride(lf, last, &mark) && mark.offset == seg->end) {
+                end = mark; // the next Segment starts at a mark
+            }
+            for (int stride = last - 1; stride > seg->stride; stride -= 1) {
+                if (!lf_stride(lf, stride, &mark)) {
+                    break;
+                }
+                if (lf_cost(mark, end) >= target) {
+                    lf_split(lf, next, stride, mark.offset);
+                    next += 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    return lf_load(lf, next);
+}
+
+/**
+ * Get the lines in the window
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @return the FileContents for the window, which stays owned by lf
+ */
+static FileContents * lf_window(LargeFile * lf) {
+    return lf->segs[lf->window].fc;
+}
+
+/**
+ * Save a large file by streaming the original file and the overlays into a new copy
+ *
+ * @param lf a pointer to the LargeFile instance
+ * @param filename the location to write to
+ */
+static void lf_save(LargeFile * lf, char * filename) {
+    // Write next to the file (through any symlinks), then swap it in once everything is
+    // there. The segments still read from the original, so it can't be written over in place.
+    char * target = save_target(filename);
+    char * temp_name;
+    int fd = open_save(target, &temp_name, false);
+    FILE * out = (fd == -1) ? NULL : fdopen(fd, "wb");
+    if (out == NULL) {
+        fileset_status(errno);
+        if (fd != -1) {
+            close(fd);
+            remove(temp_name);
+        }
+        free(temp_name);
+        free(target);
+        return;
+    }
+
+    char * block = malloc(sizeof(char) * SCAN_BLOCK);
+    bool ok = true;
+    for (int i = 0; i < lf->seg_len && ok; i += 1) {
+        Segment * seg = &lf->segs[i];
+        if (seg->fc != NULL) {
+            for (int j = 0; j < seg->fc->len && ok; j += 1) {
+                size_t len = seg->fc->data[j]->len - 1;
+                ok = (fwrite(seg->fc->data[j]->data, sizeof(char), len, out) == len);
+            }
+        } else {
+            fseek(seg->src, seg->start, SEEK_SET);
+            for (long left = seg->end - seg->start; left > 0 && ok; ) {
+                size_t want = (left < SCAN_BLOCK) ? (size_t) left : SCAN_BLOCK;
+                size_t got = fread(block, sizeof(char), want, seg->src);
+                ok = (got == want && fwrite(block, sizeof(char), got, out) == got);
+                left -= got;
+            }
+        }
+    }
+    free(block);
+
+    int errsv = errno;
+    if (fclose(out) == EOF && ok) {
+        ok = false;
+        errsv = errno;
+    }
+
+    if (ok && rename(temp_name, target) == -1) {
+        ok = false;
+        errsv = errno;
+    }
+
+    if (ok) {
+        // Segments keep reading from the old copy, which stays open after the rename
+        set_status("Successfully wrote file");
+        changed = false;
+    } else {
+        remove(temp_name);
+        fileset_status(errsv == 0 ? EIO : errsv);
+    }
+    free(temp_name);
+    free(target);
+}
+
+/**
+ * Clean up a LargeFile instance
+ *
+ * @param lf a pointer to the LargeFile instance (given by lf_open())
+ */
+static void lf_cleanup(LargeFile * lf) {
+    lf->stop = true;
+    if (!pthread_equal(lf->scanner, pthread_self())) {
+        pthread_join(lf->scanner, NULL);
+    }
+
+    for (int i = 0; i < lf->seg_len; i += 1) {
+        if (lf->segs[i].fc != NULL) {
+            fc_cleanup(lf->segs[i].fc);
+        }
+    }
+    if (lf->spill != NULL) {
+        fclose(lf->spill);
+    }
+    fclose(lf->fp);
+    pthread_mutex_destroy(&lf->lock);
+    pthread_cond_destroy(&lf->progress);
+    free(lf->segs);
+    free(lf->index);
+    free(lf);
+}
+
+/**
+ * Find out how long it's been since delta started
+ *
+ * @return the time since started, in milliseconds
+ */
+static double elapsed_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) * 1000.0 + (now.tv_nsec - started.tv_nsec) / 1000000.0;
+}
+
+/**
+ * Note down when a phase of starting up finished (for --startup-profile)
+ *
+ * @param phase the name of the phase
+ * @param at when it finished (given by elapsed_ms())
+ *
+ * @note only called from the main thread
+ */
+static void profile_mark(char * phase, double at) {
+    if (!startup_profile || profile_len == PROFILE_MAX) {
+        return;
+    }
+
+    // Keep the phases in the order they finished (background ones are added late)
+    int i = profile_len;
+    while (i > 0 && profile[i - 1].at > at) {
+        profile[i] = profile[i - 1];
+        i -= 1;
+    }
+    profile[i].phase = phase;
+    profile[i].at = at;
+    profile_len += 1;
+}
+
+/**
+ * Print the startup profile for a file to stderr, and start a new one
+ *
+ * @param filepos the location of the file
+ */
+static void profile_print(char * filepos) {
+    if (!startup_profile) {
+        return;
+    }
+
+    fprintf(stderr, "delta: startup profile for %s (ms)\n", filepos);
+    double last = 0;
+    for (int i = 0; i < profile_len; i += 1) {
+        fprintf(stderr, "    %-12s %9.2f  (+%.2f)\n", profile[i].phase, profile[i].at, profile[i].at - last);
+        last = profile[i].at;
+    }
+    profile_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+/**
+ * Scan and read a file (the body of the loader thread)
+ *
+ * @param arg a pointer to the Loader
+ */
+static void * load_run(void * arg) {
+    Loader * load = arg;
+
+    // Find out how the file is laid out (compressed files are taken as they come)
+    if (file_codec == CODEC_NONE && scan_file(load->filepos, &load->scan) == 0) {
+        load->scanned = true;
+        crlf_endings = (load->scan.eol == EOL_CRLF);
+        has_bom = (load->scan.encoding == ENC_UTF8_BOM);
+    }
+    load->scan_done = elapsed_ms();
+
+    load->fc = read_file(load->reader, load->scanned ? load->scan.lines : 0);
+    load->errsv = errno;
+    load->read_done = elapsed_ms();
+    __atomic_store_n(&load->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Guess how much memory a file would take up if all of it was read in, going
+ * by how long the lines are at the top of it
+ *
+ * @param filepos the location of the file
+ * @param size the size of the file
+ * @return the approximate number of bytes
+ */
+static size_t file_cost(char * filepos, long size) {
+    FILE * fp = fopen(filepos, "rb");
+    if (fp == NULL) {
+        return size;
+    }
+    char * buf = malloc(sizeof(char) * PREVIEW_BYTES);
+    size_t got = fread(buf, sizeof(char), PREVIEW_BYTES, fp);
+    fclose(fp);
+
+    long lines = 1;
+    for (char * nl = buf; (nl = memchr(nl, '\n', buf + got - nl)) != NULL; nl += 1) {
+        lines += 1;
+    }
+    free(buf);
+    if (got > 0) {
+        lines = (long) ((double) lines * size / got);
+    }
+    return size + lines * fl_bytes(1);
+}
+
+/**
+ * Draw the top of a file straight from the disk, to have something on the
+ * screen while the whole file is read. A compressed file is opened a second
+ * time, and only the first PREVIEW_BYTES of it are decompressed.
+ *
+ * @param filepos the location of the file
+ * @param filename the name to show in the footer
+ * @param size the size of the file, or 0 if it's compressed
+ */
+static void draw_preview(char * filepos, char * filename, long size) {
+    Codec codec;
+    CodecReader * reader = codec_open_read(filepos, &codec, PREVIEW_BYTES);
+    if (reader == NULL) {
+        return;
+    }
+    char * buf = malloc(sizeof(char) * PREVIEW_BYTES);
+    long end = 0;
+    size_t got;
+    while (end < PREVIEW_BYTES && (got = codec_read(reader, buf + end, PREVIEW_BYTES - end)) > 0) {
+        end += got;
+    }
+    codec_close_read(reader); // stopping partway through is fine here
+    FileContents * preview = split_lines(buf, end);
+    free(buf);
+
+    // Tidy up the lines the way read_file() would (the last one may be cut off)
+    for (int i = 0; i < preview->len; i += 1) {
+        FileLine * line = preview->data[i];
+        if (line->len >= 3 && line->data[line->len - 3] == '\r' && line->data[line->len - 2] == '\n') {
+            line->data[line->len - 3] = '\n';
+            line->data[line->len - 2] = '\0';
+            line->len -= 1;
+        }
+    }
+    FileLine * first = preview->data[0];
+    if (first->len >= 4 && memcmp(first->data, "\xef\xbb\xbf", 3) == 0) {
+        memmove(first->data, first->data + 3, first->len - 3);
+        first->len -= 3;
+    }
+
+    // Guess how many lines the whole file has, so the line numbers don't jump around later
+    long lines = (end >= size || end == 0) ? preview->len : (long) ((double) preview->len * size / end);
+    linenum_width = log10(line_base + lines + 1) + 1;
+
+    int text_end = (preview->len < max_pos.y - FOOTER_HEIGHT) ? preview->len : max_pos.y - FOOTER_HEIGHT;
+    draw_lines(preview, 0, 0, text_end - 1);
+    clrtobot();
+    set_status("Loading...");
+    draw_footer(filename, 0, 0, false);
+    move(0, linenum_width);
+    refresh();
+    fc_cleanup(preview);
+}
+
+/**
+ * Slide the window along the file (in window mode), when the cursor is moving off the end of it
+ *
+ * @param ed the editor state
+ * @param dir 1 to slide forwards, -1 to slide backwards
+ * @return true if the window moved (and the key has been handled)
+ */
+static bool ed_slide(Editor * ed, int dir) {
+    if (ed->lf == NULL || !lf_slide(ed->lf, dir)) {
+        return false;
+    }
+
+    ed->fc = lf_window(ed->lf);
+    ed->pos.x = 0;
+    if (dir > 0) {
+        ed->pos.y = 0;
+        ed->start_line = 0;
+    } else {
+        ed->pos.y = (ed->fc->len > 1 + FOOTER_HEIGHT) ? ed->fc->len - 1 - FOOTER_HEIGHT : 0;
+        ed->start_line = (ed->pos.y >= max_pos.y - FOOTER_HEIGHT) ? ed->pos.y - max_pos.y + FOOTER_HEIGHT + 1 : 0;
+    }
+    ed->primary = cl_clear(&ed->cursors, ed->pos);
+    ed->marking = false;
+    return true;
+}
+
+/**
+ * Move the extra cursors along with the main one, staying on their lines
+ *
+ * @param ed the editor state
+ * @param dx -1 for left, 1 for right
+ */
+static void ed_shift_cursors(Editor * ed, int dx) {
+    if (ed->cursors.len == 1) {
+        return;
+    }
+
+    for (int i = 0; i < ed->cursors.len; i += 1) {
+        CursorPos * cur = &ed->cursors.data[i];
+        if (i == ed->primary) {
+            *cur = ed->pos;
+        } else if (dx < 0 && cur->x > 0) {
+            cur->x -= 1;
+        } else if (dx > 0 && cur->x < ed->fc->data[cur->y]->len - 2) {
+            cur->x += 1;
+        }
+    }
+    ed->primary = cl_normalize(&ed->cursors, ed->primary);
+}
+
+/**
+ * Copy the selection to the clipboard, and remove it if it's being cut
+ *
+ * @param ed the editor state
+ * @param cut true to remove the selection as well
+ */
+static void ed_copy(Editor * ed, bool cut) {
+    CursorPos start = clamp_pos(ed->fc, ed->mark);
+    CursorPos end = clamp_pos(ed->fc, ed->pos);
+    if (cursor_cmp(&start, &end) > 0) {
+        CursorPos temp_p = start;
+        start = end;
+        end = temp_p;
+    }
+
+    if (!ed->marking || cursor_cmp(&start, &end) == 0) {
+        set_status_err("Nothing selected");
+        return;
+    }
+
+    if (clipboard != NULL) {
+        fc_cleanup(clipboard);
+    }
+    clipboard = fc_copy(ed->fc, start, end);
+    osc52_copy(clipboard);
+
+    if (cut) {
+        fc_delete_range(ed->fc, start, end);
+        ed->pos = start;
+        ed->primary = cl_clear(&ed->cursors, ed->pos);
+        if (ed->pos.y < ed->start_line) {
+            ed->start_line = ed->pos.y;
+        }
+        mark_changed();
+    }
+    ed->marking = false;
+    set_status(cut ? "Cut selection" : "Copied selection");
+}
+
+/**
+ * Insert the typed character (at every cursor at once)
+ *
+ * @param ed the editor state
+ */
+static void act_insert(Editor * ed) {
+    if (ed->input < 32 || ed->input > 126) {
+        return;
+    }
+
+    ed->cursors.data[ed->primary] = ed->pos;
+    fc_insert_batch(ed->fc, ed->cursors.data, ed->cursors.len, (char) ed->input, &ed->dirty_first, &ed->dirty_last);
+    ed->pos = ed->cursors.data[ed->primary];
+    mark_changed();
+}
+
+/**
+ * Move left, onto the end of the line above from the start of a line
+ *
+ * @param ed the editor state
+ */
+static void act_left(Editor * ed) {
+    if (at_bol(ed->pos.x, ed->pos.y, ed->fc)) {
+        if (valid_move(0, ed->pos.y - 1, ed->fc)) {
+            ed->pos.y -= 1;
+            ed->pos.x = (ed->fc->data[ed->pos.y]->len - 2);
+        }
+    } else if (valid_move(ed->pos.x - 1, ed->pos.y, ed->fc)) {
+        ed->pos.x -= 1;
+    }
+    ed_shift_cursors(ed, -1);
+}
+
+/**
+ * Move right, onto the start of the line below from the end of a line
+ *
+ * @param ed the editor state
+ */
+static void act_right(Editor * ed) {
+    if (at_eol(ed->pos.x, ed->pos.y, ed->fc)) {
+        if (valid_move(0, ed->pos.y + 1, ed->fc)) {
+            ed->pos.x = 0;
+            ed->pos.y += 1;
+        }
+    } else if (valid_move(ed->pos.x + 1, ed->pos.y, ed->fc)) {
+        ed->pos.x += 1;
+    }
+    ed_shift_cursors(ed, 1);
+}
+
+/**
+ * Move up a line
+ *
+ * @param ed the editor state
+ */
+static void act_up(Editor * ed) {
+    if (ed->pos.y == 0 && ed_slide(ed, -1)) {
+        return;
+    }
+    if (valid_move(ed->pos.x, ed->pos.y - 1, ed->fc)) {
+        ed->pos.y -= 1;
+    }
+}
+
+/**
+ * Move down a line
+ *
+ * @param ed the editor state
+ */
+static void act_down(Editor * ed) {
+    if (ed->pos.y + 1 >= ed->fc->len - FOOTER_HEIGHT && ed_slide(ed, 1)) {
+        return;
+    }
+    if (valid_move(ed->pos.x, ed->pos.y + 1, ed->fc)) {
+        ed->pos.y += 1;
+    }
+}
+
+/**
+ * Move up a page
+ *
+ * @param ed the editor state
+ */
+static void act_page_up(Editor * ed) {
+    if (ed->start_line == 0 && ed_slide(ed, -1)) {
+        return;
+    }
+
+    // Don't scroll back past the first line
+    int jump = (ed->start_line < config.page_jump) ? ed->start_line : config.page_jump;
+    if (jump > 0) {
+        ed->pos.y -= jump;
+        ed->start_line -= jump;
+
+        refresh();
+    }
+}
+
+/**
+ * Move down a page
+ *
+ * @param ed the editor state
+ */
+static void act_page_down(Editor * ed) {
+    if (ed->fc->len <= ed->pos.y + ed->start_line + config.page_jump && ed_slide(ed, 1)) {
+        return;
+    }
+
+    if (ed->fc->len > ed->pos.y + ed->start_line + config.page_jump) {
+        ed->pos.y += config.page_jump;
+        ed->start_line += config.page_jump;
+
+        refresh();
+    }
+}
+
+/**
+ * Add a cursor to the column on the line above the top cursor
+ *
+ * @param ed the editor state
+ */
+static void act_cursor_up(Editor * ed) {
+    ed->cursors.data[ed->primary] = ed->pos;
+    int y = ed->cursors.data[0].y - 1;
+    if (valid_move(0, y, ed->fc)) {
+        int x = (ed->pos.x < ed->fc->data[y]->len - 2) ? ed->pos.x : ed->fc->data[y]->len - 2;
+        cl_push(&ed->cursors, (CursorPos) {.x = x, .y = y});
+        ed->primary = cl_normalize(&ed->cursors, ed->primary);
+    }
+}
+
+/**
+ * Add a cursor to the column on the line below the bottom cursor
+ *
+ * @param ed the editor state
+ */
+static void act_cursor_down(Editor * ed) {
+    ed->cursors.data[ed->primary] = ed->pos;
+    int y = ed->cursors.data[ed->cursors.len - 1].y + 1;
+    if (valid_move(0, y, ed->fc)) {
+        int x = (ed->pos.x < ed->fc->data[y]->len - 2) ? ed->pos.x : ed->fc->data[y]->len - 2;
+        cl_push(&ed->cursors, (CursorPos) {.x = x, .y = y});
+        ed->primary = cl_normalize(&ed->cursors, ed->primary);
+    }
+}
+
+/**
+ * Drop the extra cursors
+ *
+ * @param ed the editor state
+ */
+static void act_escape(Editor * ed) {
+    ed->primary = cl_clear(&ed->cursors, ed->pos);
+}
+
+/**
+ * Ask for some text, and put a cursor on every match
+ *
+ * @param ed the editor state
+ */
+static void act_find(Editor * ed) {
+    char needle[STATUS_LEN];
+    if (!prompt("Find: ", needle, STATUS_LEN)) {
+        return;
+    }
+
+    ed->cursors.len = 0;
+    int found = cl_add_matches(&ed->cursors, ed->fc, needle);
+    if (found == 0) {
+        ed->primary = cl_clear(&ed->cursors, ed->pos);
+        set_status_err("No matches");
+        return;
+    }
+
+    // Follow the first match
+    ed->primary = 0;
+    ed->pos = ed->cursors.data[ed->primary];
+    if (ed->pos.y < ed->start_line || ed->pos.y >= ed->start_line + max_pos.y - FOOTER_HEIGHT) {
+        ed->start_line = ed->pos.y;
+    }
+    char temp_status[STATUS_LEN];
+    snprintf(temp_status, STATUS_LEN, "%d cursors", found);
+    set_status(temp_status);
+}
+
+/**
+ * Start or drop a selection at the cursor
+ *
+ * @param ed the editor state
+ */
+static void act_mark(Editor * ed) {
+    ed->primary = cl_clear(&ed->cursors, ed->pos);
+    ed->marking = !ed->marking;
+    ed->mark = ed->pos;
+    set_status(ed->marking ? "Mark set" : "Mark cleared");
+}
+
+/**
+ * Copy the selection
+ *
+ * @param ed the editor state
+ */
+static void act_copy(Editor * ed) {
+    ed_copy(ed, false);
+}
+
+/**
+ * Cut the selection
+ *
+ * @param ed the editor state
+ */
+static void act_cut(Editor * ed) {
+    ed_copy(ed, true);
+}
+
+/**
+ * Paste the clipboard at the cursor
+ *
+ * @param ed the editor state
+ */
+static void act_paste(Editor * ed) {
+    if (clipboard == NULL) {
+        set_status_err("Nothing to paste");
+        return;
+    }
+
+    ed->primary = cl_clear(&ed->cursors, ed->pos);
+    ed->marking = false;
+    ed->pos = clamp_pos(ed->fc, ed->pos);
+    fc_paste(ed->fc, &ed->pos, clipboard);
+    if (ed->pos.y >= ed->start_line + max_pos.y - FOOTER_HEIGHT) {
+        ed->start_line = ed->pos.y - max_pos.y + FOOTER_HEIGHT + 1;
+    }
+    mark_changed();
+}
+
+/**
+ * Remove the character before (backspace) or under (delete) every cursor
+ *
+ * @param ed the editor state
+ * @param before true for backspace, false for delete
+ */
+static void ed_remove(Editor * ed, bool before) {
+    if (ed->cursors.len > 1) {
+        ed->cursors.data[ed->primary] = ed->pos;
+        fc_remove_batch(ed->fc, ed->cursors.data, ed->cursors.len, before, &ed->dirty_first, &ed->dirty_last);
+        ed->primary = cl_normalize(&ed->cursors, ed->primary);
+        ed->pos = ed->cursors.data[ed->primary];
+        mark_changed();
+    } else if (!before) {
+        mark_changed();
+        fc_remove(ed->fc, ed->pos.x, ed->pos.y);
+    } else if (ed->pos.x >= 1) {
+        mark_changed();
+        ed->pos.x -= 1;
+        fc_remove(ed->fc, ed->pos.x, ed->pos.y);
+    }
+}
+
+/**
+ * Remove the character before the cursor
+ *
+ * @param ed the editor state
+ */
+static void act_backspace(Editor * ed) {
+    ed_remove(ed, true);
+}
+
+/**
+ * Remove the character under the cursor
+ *
+ * @param ed the editor state
+ */
+static void act_delete(Editor * ed) {
+    ed_remove(ed, false);
+}
+
+/**
+ * Split the line at the cursor (only one line can be split at a time)
+ *
+ * @param ed the editor state
+ */
+static void act_newline(Editor * ed) {
+    if (ed->cursors.len > 1) {
+        beep();
+        return;
+    }
+
+    mark_changed();
+    fc_newline(ed->fc, ed->pos.x, ed->pos.y);
+    if (ed->fc->len > ed->old_len) {
+        ed->pos.x = 0;
+        ed->pos.y += 1;
+        if (ed->pos.y >= ed->start_line + max_pos.y - FOOTER_HEIGHT) {
+            ed->start_line = ed->pos.y - max_pos.y + FOOTER_HEIGHT + 1;
+        }
+    }
+}
+
+/**
+ * Indent at every cursor, with a tab or spaces
+ *
+ * @param ed the editor state
+ */
+static void act_tab(Editor * ed) {
+    if (ed->cursors.len > 1) {
+        ed->cursors.data[ed->primary] = ed->pos;
+        for (int i = 0; i < ((ed->tab_does == -1) ? 1 : ed->tab_does); i += 1) {
+            fc_insert_batch(ed->fc, ed->cursors.data, ed->cursors.len, (ed->tab_does == -1) ? '\t' : ' ',
+                            &ed->dirty_first, &ed->dirty_last);
+        }
+        ed->pos = ed->cursors.data[ed->primary];
+        mark_changed();
+        return;
+    }
+
+    // Only move along when the character went in (fc_insert ignores positions off the end of the line)
+    for (int i = 0; i < ((ed->tab_does == -1) ? 1 : ed->tab_does); i += 1) {
+        int old_len = ed->fc->data[ed->pos.y]->len;
+        fc_insert(ed->fc, ed->pos.x, ed->pos.y, (ed->tab_does == -1) ? '\t' : ' ');
+        if (ed->fc->data[ed->pos.y]->len > old_len) {
+            ed->pos.x += 1;
+        }
+    }
+    mark_changed();
+}
+
+/**
+ * Save the file, in the background (after the current save, if there is one)
+ *
+ * @param ed the editor state
+ */
+static void act_save(Editor * ed) {
+    // A replay has to save the same lines every time, so don't leave when the next save starts up to timing
+    if (replay != NULL && ed->saver != NULL) {
+        save_poll(ed->saver, true);
+        ed->saver = NULL;
+    }
+
+    if (changed && ed->lf != NULL) {
+        lf_save(ed->lf, ed->filepos);
+    } else if (changed && ed->saver != NULL) {
+        ed->save_again = (edits != ed->saver->edits);
+    } else if (changed) {
+        ed->saver = save_start(ed->fc, ed->filepos);
+        ed->last_save = time(NULL);
+    }
+}
+
+/**
+ * Stop editing the file
+ *
+ * @param ed the editor state
+ */
+static void act_exit(Editor * ed) {
+    ed->quit = true;
+}
+
+/**
+ * Turn the selection into a column of cursors: one on every line from the
+ * mark to the cursor, in the mark's column
+ *
+ * @param ed the editor state
+ */
+static void act_column(Editor * ed) {
+    if (!ed->marking) {
+        set_status_err("Nothing selected");
+        return;
+    }
+
+    CursorPos mark = clamp_pos(ed->fc, ed->mark);
+    int first = (mark.y < ed->pos.y) ? mark.y : ed->pos.y;
+    int last = (mark.y < ed->pos.y) ? ed->pos.y : mark.y;
+    ed->cursors.len = 0;
+    for (int y = first; y <= last; y += 1) {
+        cl_push(&ed->cursors, clamp_pos(ed->fc, (CursorPos) {.x = mark.x, .y = y}));
+    }
+
+    // The cursor stays on its line, moved over to the column
+    ed->primary = ed->pos.y - first;
+    ed->pos = ed->cursors.data[ed->primary];
+    ed->marking = false;
+
+    char temp_status[STATUS_LEN];
+    snprintf(temp_status, STATUS_LEN, "%d cursors", ed->cursors.len);
+    set_status(temp_status);
+}
+
+static int edit_file(char * filepos) {
+    CodecReader * reader = codec_open_read(filepos, &file_codec, 0);
+    if (reader == NULL) {
+        perror("delta");
+        endwin();
+        return EXIT_FAILURE;
+    }
+
+    // Only keep a window of the file in memory if it's too big
+    struct stat info;
+    bool stated = (stat(filepos, &info) == 0);
+    bool windowed = (file_codec == CODEC_NONE && stated && file_cost(filepos, info.st_size) > window_budget / 2);
+    profile_mark("open", elapsed_ms());
+
+    // Start reading the file in the background, while the terminal is set up
+    crlf_endings = false;
+    has_bom = false;
+    line_base = 0;
+    Loader load = {.filepos = filepos, .reader = reader, .scanned = false, .fc = NULL, .done = false};
+    bool loading = !windowed;
+    if (loading && pthread_create(&load.thread, NULL, load_run, &load) != 0) {
+        load_run(&load);
+        load.thread = pthread_self();
+    }
+
+    initscr(); // Initalize ncurses
+    raw();     // Get raw input
+    noecho();  // Don't echo characters to the terminal
+    keypad(stdscr, TRUE); // Enable reading of all keys
+
+    // Make the color pairs (header, status bar and status bar error)
+    start_color();
+    for (int i = 0; i < PAIR_COUNT; i += 1) {
+        init_pair(i + 1, config.colors[i][0], config.colors[i][1]);
+    }
+    update_max();
+    profile_mark("terminal", elapsed_ms());
+
+    // Remove the path from the file location
+    char * filename = NULL;
+    if ((filename = strchr(filepos, '/')) != NULL) {
+        filename += 1;
+    } else {
+        filename = filepos;
+    }
+
+    // Put the top of the file up while the rest is still being read (or the first window is)
+    bool previewed = (stated && (windowed || !__atomic_load_n(&load.done, __ATOMIC_ACQUIRE)));
+    if (previewed) {
+        draw_preview(filepos, filename, (file_codec == CODEC_NONE) ? info.st_size : 0);
+        profile_mark("first frame", elapsed_ms());
+    }
+
+    // Initalize more things
+    int tab_does = (config.tab_width != 0) ? config.tab_width : 4;
+    char scan_status[STATUS_LEN] = "";
+    Editor ed = {.filepos = filepos, .fc = NULL, .lf = NULL};
+    if (windowed) {
+        codec_close_read(reader);
+        if ((ed.lf = lf_open(filepos, info.st_size, window_budget)) != NULL) {
+            ed.fc = lf_window(ed.lf);
+        }
+        profile_mark("window", elapsed_ms());
+    } else {
+        if (!pthread_equal(load.thread, pthread_self())) {
+            pthread_join(load.thread, NULL);
+        }
+        if (load.scanned) {
+            profile_mark("scan", load.scan_done);
+        }
+        profile_mark("read", load.read_done);
+        ed.fc = load.fc;
+        errno = load.errsv;
+    }
+    if (ed.fc == NULL) {
+        endwin();
+        perror("delta");
+        return EXIT_FAILURE;
+    }
+
+    // Follow the file's indentation, unless the config says what tab does
+    if (load.scanned) {
+        ScanResult scan = load.scan;
+        if (config.tab_width == 0 && scan.tab_indents > scan.space_indents) {
+            tab_does = -1;
+        } else if (config.tab_width == 0 && scan.space_indents > 0) {
+            tab_does = scan.indent_width;
+        }
+
+        char * encodings[] = {"ASCII", "UTF-8", "UTF-8 BOM", "Latin-1"};
+        char * endings[] = {"LF", "CRLF", "mixed endings"};
+        char indent[16] = "tabs";
+        if (tab_does != -1) {
+            snprintf(indent, sizeof(indent), "%d spaces", tab_does);
+        }
+        snprintf(scan_status, STATUS_LEN, "%s, %s, %s", encodings[scan.encoding], endings[scan.eol], indent);
+    }
+    ed.tab_does = tab_does;
+    update_max();
+    
+    changed = false;
+    set_status(scan_status);
+
+    // Even more initalization
+    ed.pos = (CursorPos) {.x = 0, .y = 0};
+    ed.start_line = 0;
+    ed.cursors = (CursorList) {.data = malloc(sizeof(CursorPos)), .len = 1, .cap = 1};
+    ed.primary = cl_clear(&ed.cursors, ed.pos);
+    ed.marking = false;
+    ed.mark = ed.pos;
+    ed.saver = NULL;
+    ed.save_again = false;
+    ed.last_save = time(NULL);
+    ed.quit = false;
+    draw_file(ed.fc, 0);
+    draw_footer(filename, ed.pos.x, line_base + ed.pos.y, changed);
+    move(ed.pos.y, ed.pos.x + linenum_width);
+    refresh();
+    profile_mark(previewed ? "ready" : "first frame", elapsed_ms());
+    
+    // The editor loop. Reads input, processes, writes the result and does it again.
+    while (true) {
+        // Read input from the keyboard (waking up now and then to check on saves)
+        timeout((ed.saver != NULL) ? SAVE_TICK : (autosave > 0 && ed.lf == NULL) ? 1000 : -1);
+        int input = read_key();
+
+        // See if the save in the background has finished, and start the next one
+        bool save_done = (ed.saver != NULL && save_poll(ed.saver, false));
+        if (save_done) {
+            ed.saver = NULL;
+        }
+        if (ed.saver == NULL && changed && ed.lf == NULL &&
+            (ed.save_again || (autosave > 0 && time(NULL) - ed.last_save >= autosave))) {
+            ed.saver = save_start(ed.fc, filepos);
+            ed.save_again = false;
+            ed.last_save = time(NULL);
+        }
+
+        // Nothing was pressed, so only the footer might need updating
+        if (input == ERR) {
+            if (ed.saver != NULL || save_done) {
+                if (ed.saver != NULL) {
+                    save_progress(ed.saver);
+                }
+                draw_footer(filename, ed.pos.x, line_base + ed.pos.y, changed);
+                move(ed.pos.y - ed.start_line, ed.pos.x + linenum_width);
+                refresh();
+            }
+            continue;
+        }
+
+        // Remember the state of the screen, to see how much has to be redrawn
+        FileContents * old_fc = ed.fc;
+        int old_start = ed.start_line;
+        ed.input = input;
+        ed.old_len = ed.fc->len;
+        ed.dirty_first = -1;
+        ed.dirty_last = -1;
+
+        // Look up what the key is bound to
+        Action act = (0 <= input && input < CONFIG_KEYS) ? config.keys[input] : ACT_NONE;
+        if (replay_done) {
+            act = ACT_EXIT;
+        }
+
+        // Editing drops the selection
+        if (ed.marking && (act == ACT_INSERT || act == ACT_BACKSPACE || act == ACT_DELETE ||
+                           act == ACT_NEWLINE || act == ACT_TAB)) {
+            ed.marking = false;
+        }
+
+        // Vertical movement drops the extra cursors
+        if (ed.cursors.len > 1 && (act == ACT_UP || act == ACT_DOWN || act == ACT_PAGE_UP || act == ACT_PAGE_DOWN)) {
+            ed.primary = cl_clear(&ed.cursors, ed.pos);
+        }
+
+        if (actions[act] != NULL) {
+            actions[act](&ed);
+        }
+        if (ed.quit) {
+            break;
+        }
+
+        // Draw the updated file to the screen, only touching the changed lines if nothing moved
+        FileContents * fc = ed.fc;
+        CursorPos pos = ed.pos;
+#ifdef DELTA_CHECK
+        fc_check(fc, &ed.cursors);
+#endif
+        if (ed.dirty_first != -1 && fc == old_fc && fc->len == ed.old_len && ed.start_line == old_start) {
+            draw_lines(fc, ed.start_line, ed.dirty_first, ed.dirty_last);
+        } else {
+            draw_file(fc, ed.start_line);
+        }
+        draw_cursors(&ed.cursors, ed.primary, ed.start_line);
+        if (ed.marking) {
+            CursorPos start = clamp_pos(fc, ed.mark);
+            CursorPos end = clamp_pos(fc, pos);
+            if (cursor_cmp(&start, &end) > 0) {
+                draw_selection(fc, end, start, ed.start_line);
+            } else {
+                draw_selection(fc, start, end, ed.start_line);
+            }
+        }
+        if (ed.saver != NULL) {
+            save_progress(ed.saver);
+        }
+        draw_footer(filename, pos.x, line_base + pos.y, changed);
+        move(pos.y - ed.start_line, pos.x + linenum_width);       
+        update_max();
+        refresh();
+    }
+
+    // Let the last save finish, and run the one that was waiting on it
+    if (ed.saver != NULL) {
+        save_poll(ed.saver, true);
+        if (ed.save_again && changed) {
+            save_poll(save_start(ed.fc, filepos), true);
+        }
+    }
+
+    if (ed.lf != NULL) {
+        lf_cleanup(ed.lf);
+    } else {
+        fc_cleanup(ed.fc);
+    }
+    free(ed.cursors.data);
+    endwin();
+    profile_print(filepos);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The main function
+ *
+ * @param argc the number of command-line arguments
+ * @param argv a pointer to the command-line arguments
+ */
+int main(int argc, char * argv[]) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // umask() can only be read by setting it, so do it before any threads start
+    file_mask = umask(022);
+    umask(file_mask);
+    if (argc == 1) {
+        return EXIT_FAILURE; // Replace with some sort of tutorial/splash page
+    }
+
+    // Read the settings in ~/.deltarc (or its cache), which the options below can override
+    config_defaults(&config);
+    char * home = getenv("HOME");
+    if (home != NULL) {
+        char * path = malloc(strlen(home) + 16);
+        char * cache_path = malloc(strlen(home) + 16);
+        sprintf(path, "%s/.deltarc", home);
+        sprintf(cache_path, "%s/.deltarc.cache", home);
+
+        char error[STATUS_LEN * 2] = "";
+        int result = config_load(path, cache_path, &config, error, sizeof(error));
+        int errsv = errno;
+        if (result == -1 && errsv == EINVAL) {
+            fprintf(stderr, "delta: %s: %s\n", path, error);
+        } else if (result == -1 && errsv != ENOENT) {
+            fprintf(stderr, "delta: %s: %s\n", path, strerror(errsv));
+        }
+        free(path);
+        free(cache_path);
+        if (result == -1 && errsv != ENOENT) {
+            return EXIT_FAILURE;
+        }
+    }
+    window_budget = (size_t) config.window_budget << 20;
+    autosave = config.autosave;
+    double config_done = elapsed_ms();
+    
     for (int i = 1; i < argc; i += 1) {
+        // --window-budget=N caps the memory used for a file at N megabytes
+        if (strncmp(argv[i], "--window-budget=", 16) == 0) {
+            long megabytes = strtol(argv[i] + 16, NULL, 10);
+            if (megabytes <= 0) {
+                fprintf(stderr, "delta: invalid window budget '%s'\n", argv[i] + 16);
+                return EXIT_FAILURE;
+            }
+            window_budget = (size_t) megabytes << 20;
+            continue;
+        }
+
+        // --autosave=N saves the file in the background every N seconds
+        if (strncmp(argv[i], "--autosave=", 11) == 0) {
+            autosave = (int) strtol(argv[i] + 11, NULL, 10);
+            if (autosave < 0) {
+                fprintf(stderr, "delta: invalid autosave interval '%s'\n", argv[i] + 11);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        // --startup-profile prints how long each part of opening a file took
+        if (strcmp(argv[i], "--startup-profile") == 0) {
+            startup_profile = true;
+            profile_mark("config", config_done);
+            continue;
+        }
+
+        // --replay FILE reads the keys from a script instead of the keyboard
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            i += 1;
+            if ((replay = fopen(argv[i], "r")) == NULL) {
+                perror("delta");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
         int file_status;
         if ((file_status = edit_file(argv[i])) != EXIT_SUCCESS) {
             return file_status;
         }
     }
+
+    if (clipboard != NULL) {
+        fc_cleanup(clipboard);
+    }
+    if (replay != NULL) {
+        fclose(replay);
+    }
     return EXIT_SUCCESS;    
 }
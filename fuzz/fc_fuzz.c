@@ -0,0 +1,708 @@
+/**
+ * fc_fuzz.c
+ *
+ * A differential fuzzer for the document core. Each input is turned into a
+ * starting document and a list of edits, which are made to a FileContents and
+ * to a plain string at the same time. After every edit the two have to hold
+ * the same text, and the FileContents has to pass fc_check(). Saves are made
+ * too: the file fc_write() writes (with CRLF endings, a byte order mark or gzip
+ * compression) is read back and compared with what the string says it should be.
+ *
+ * make fuzz builds this with libFuzzer. make check builds it with a stand-in
+ * for libFuzzer (-DFUZZ_STANDALONE) that makes up random inputs, so it runs
+ * anywhere gcc does. Either way, the inputs given on the command line (like
+ * a crash saved by libFuzzer) are run instead, and -runs=N sets how many
+ * inputs to try.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "../utils/codec.h"
+#include "../utils/file_contents.h"
+
+#ifndef DELTA_CHECK
+#error "fc_fuzz needs fc_check(), build it with -DDELTA_CHECK"
+#endif
+
+// Inputs stop being read after this many edits, so every run stays quick
+#define FUZZ_MAX_EDITS 64
+// The most characters the starting document can have
+#define FUZZ_MAX_START 64
+// The most cursors a batch edit uses
+#define FUZZ_MAX_CURSORS 4
+// The template for the file saves are written to
+#define FUZZ_SAVE_TEMPLATE "/tmp/fc_fuzz.XXXXXX"
+
+/**
+ * The bytes of an input, read from the front as the edits are made up
+ */
+typedef struct {
+    const uint8_t * data;
+    size_t size;
+    size_t at;
+} Input;
+
+/**
+ * The reference model: the whole document as one string
+ */
+typedef struct {
+    char * data;
+    int len;
+} Model;
+
+// Where saves are written, once save_path() has made it
+static char save_file[] = FUZZ_SAVE_TEMPLATE;
+
+/**
+ * Take the next byte of an input
+ *
+ * @param in the input
+ * @return the byte, or 0 once the input has run out
+ */
+static int next_byte(Input * in) {
+    if (in->at >= in->size) {
+        return 0;
+    }
+    in->at += 1;
+    return in->data[in->at - 1];
+}
+
+/**
+ * Stop with a message when the FileContents and the model don't agree
+ *
+ * @param what the edit that was being made
+ */
+static void fail(const char * what) {
+    fprintf(stderr, "fc_fuzz: the document and the model differ after %s\n", what);
+    abort();
+}
+
+/**
+ * Put some characters into the model
+ *
+ * @param m the model
+ * @param at the offset to put them at
+ * @param text the characters
+ * @param len the number of characters
+ */
+static void model_insert(Model * m, int at, const char * text, int len) {
+    m->data = realloc(m->data, m->len + len + 1);
+    memmove(m->data + at + len, m->data + at, m->len - at + 1);
+    memcpy(m->data + at, text, len);
+    m->len += len;
+}
+
+/**
+ * Take some characters out of the model
+ *
+ * @param m the model
+ * @param at the offset of the first character
+ * @param len the number of characters
+ */
+static void model_erase(Model * m, int at, int len) {
+    memmove(m->data + at, m->data + at + len, m->len - at - len + 1);
+    m->len -= len;
+}
+
+/**
+ * Count the lines in the model (one more than the number of newlines)
+ *
+ * @param m the model
+ * @return the number of lines
+ */
+static int model_lines(Model * m) {
+    int lines = 1;
+    for (int i = 0; i < m->len; i += 1) {
+        lines += (m->data[i] == '\n');
+    }
+    return lines;
+}
+
+/**
+ * Find a line in the model
+ *
+ * @param m the model
+ * @param y the line to find
+ * @param len set to the length of the line, including its newline
+ * @return the offset of the line, or -1 if the model doesn't have that line
+ */
+static int model_line(Model * m, int y, int * len) {
+    if (y < 0) {
+        return -1;
+    }
+    int start = 0;
+    for (int i = 0; i < y; i += 1) {
+        char * nl = memchr(m->data + start, '\n', m->len - start);
+        if (nl == NULL) {
+            return -1;
+        }
+        start = nl - m->data + 1;
+    }
+    char * nl = memchr(m->data + start, '\n', m->len - start);
+    *len = (nl == NULL) ? m->len - start : nl - (m->data + start) + 1;
+    return start;
+}
+
+/**
+ * Work out the position of an offset in the model
+ *
+ * @param m the model
+ * @param at the offset
+ * @return the position
+ */
+static CursorPos model_pos(Model * m, int at) {
+    CursorPos p = {.x = 0, .y = 0};
+    for (int i = 0; i < at; i += 1) {
+        p.x += 1;
+        if (m->data[i] == '\n') {
+            p.x = 0;
+            p.y += 1;
+        }
+    }
+    return p;
+}
+
+/**
+ * Put a position back inside the model, the way clamp_pos() should
+ *
+ * @param m the model
+ * @param p the position to fix
+ * @return the closest position that exists
+ */
+static CursorPos model_clamp(Model * m, CursorPos p) {
+    int lines = model_lines(m);
+    p.y = (p.y < 0) ? 0 : (p.y >= lines ? lines - 1 : p.y);
+
+    int len;
+    int start = model_line(m, p.y, &len);
+    int max_x = (len > 0 && m->data[start + len - 1] == '\n') ? len - 1 : len;
+    p.x = (p.x < 0) ? 0 : (p.x > max_x ? max_x : p.x);
+    return p;
+}
+
+/**
+ * Check that a FileContents is well formed and holds the same text as a model
+ *
+ * @param fc the FileContents
+ * @param m the model
+ * @param what the edit that was just made, for the message if they differ
+ */
+static void compare(FileContents * fc, Model * m, const char * what) {
+    CursorList none = {.data = NULL, .len = 0, .cap = 0};
+    fc_check(fc, &none);
+
+    int at = 0;
+    for (int i = 0; i < fc->len; i += 1) {
+        int len = fc->data[i]->len - 1;
+        if (at + len > m->len || memcmp(fc->data[i]->data, m->data + at, len) != 0) {
+            fail(what);
+        }
+        at += len;
+    }
+    if (at != m->len) {
+        fail(what);
+    }
+}
+
+/**
+ * Make up a row, sometimes one just outside the document
+ *
+ * @param in the input
+ * @param m the model
+ * @return the row
+ */
+static int pick_row(Input * in, Model * m) {
+    return next_byte(in) % (model_lines(m) + 2) - 1;
+}
+
+/**
+ * Make up a column, sometimes one just outside the line
+ *
+ * @param in the input
+ * @param m the model
+ * @param y the row the column is on
+ * @return the column
+ */
+static int pick_col(Input * in, Model * m, int y) {
+    int len = 0;
+    model_line(m, y, &len);
+    return next_byte(in) % (len + 3) - 1;
+}
+
+/**
+ * Make up a set of cursors, sorted and without any repeats (like cl_normalize())
+ *
+ * @param in the input
+ * @param m the model
+ * @param curs filled in with the cursors, which has room for FUZZ_MAX_CURSORS
+ * @return the number of cursors
+ */
+static int pick_cursors(Input * in, Model * m, CursorPos * curs) {
+    int n = 1 + next_byte(in) % FUZZ_MAX_CURSORS;
+    for (int i = 0; i < n; i += 1) {
+        curs[i].y = pick_row(in, m);
+        curs[i].x = pick_col(in, m, curs[i].y);
+    }
+    qsort(curs, n, sizeof(CursorPos), cursor_cmp);
+
+    int out = 0;
+    for (int i = 0; i < n; i += 1) {
+        if (out == 0 || cursor_cmp(&curs[out - 1], &curs[i]) != 0) {
+            curs[out] = curs[i];
+            out += 1;
+        }
+    }
+    return out;
+}
+
+/**
+ * Turn a byte into a character that can be typed (anything but a newline)
+ *
+ * @param b the byte
+ * @return the character
+ */
+static char typed_char(int b) {
+    return (b % 16 == 0) ? '\t' : (char) ('a' + b % 26);
+}
+
+/**
+ * Make the FileContents for some text, splitting it into lines like read_file()
+ *
+ * @param text the characters
+ * @param len the number of characters
+ * @return the FileContents, which must be freed using fc_cleanup
+ */
+static FileContents * make_contents(const char * text, int len) {
+    FileContents * fc = malloc(sizeof(FileContents));
+    fc->data = NULL;
+    fc->len = 0;
+    int cap = 0;
+
+    const char * cur = text;
+    const char * nl;
+    while ((nl = memchr(cur, '\n', text + len - cur)) != NULL) {
+        fc_append(fc, &cap, make_line(NULL, 0, (char *) cur, nl - cur + 1));
+        cur = nl + 1;
+    }
+    fc_append(fc, &cap, make_line(NULL, 0, (char *) cur, text + len - cur));
+    return fc;
+}
+
+/**
+ * Share every line of a FileContents, like a snapshot taken for a save
+ *
+ * @param fc the FileContents to share
+ * @return the copy, which must be freed using fc_cleanup
+ */
+static FileContents * share_contents(FileContents * fc) {
+    FileContents * copy = malloc(sizeof(FileContents));
+    copy->data = malloc(sizeof(FileLine *) * fc->len);
+    copy->len = fc->len;
+    for (int i = 0; i < fc->len; i += 1) {
+        copy->data[i] = fl_share(fc->data[i]);
+    }
+    return copy;
+}
+
+/**
+ * Remove the file saves are written to (registered with atexit())
+ */
+static void remove_save() {
+    remove(save_file);
+}
+
+/**
+ * Get the file saves are written to, making it the first time
+ *
+ * @return the location of the file, which is removed when the fuzzer exits
+ */
+static char * save_path() {
+    static bool made = false;
+    if (!made) {
+        int fd = mkstemp(save_file);
+        if (fd == -1) {
+            perror("fc_fuzz: mkstemp");
+            abort();
+        }
+        close(fd);
+        atexit(remove_save);
+        made = true;
+    }
+    return save_file;
+}
+
+/**
+ * Save a FileContents, read the file back and check it holds what the model says it should
+ *
+ * @param fc the FileContents
+ * @param m the model
+ * @param codec the compression format to save with
+ * @param bom true to save with a byte order mark
+ * @param crlf true to save with CRLF line endings
+ */
+static void check_save(FileContents * fc, Model * m, Codec codec, bool bom, bool crlf) {
+    // Write over the last save and then cut off whatever is left of it. Truncating
+    // to nothing first would make some file systems flush the file on every save.
+    char * path = save_path();
+    int fd = open(path, O_WRONLY);
+    int end_fd = (fd == -1) ? -1 : dup(fd);
+    if (end_fd == -1 || fc_write(fc, fd, codec, bom, crlf, NULL) == -1 ||
+        ftruncate(end_fd, lseek(end_fd, 0, SEEK_CUR)) == -1) {
+        perror("fc_fuzz: fc_write");
+        abort();
+    }
+    close(end_fd);
+
+    // What the file should hold
+    char * want = malloc(m->len * 2 + 4);
+    int want_len = 0;
+    if (bom) {
+        memcpy(want, "\xef\xbb\xbf", 3);
+        want_len = 3;
+    }
+    for (int i = 0; i < m->len; i += 1) {
+        if (crlf && m->data[i] == '\n') {
+            want[want_len] = '\r';
+            want_len += 1;
+        }
+        want[want_len] = m->data[i];
+        want_len += 1;
+    }
+
+    // What it does hold
+    Codec got_codec;
+    CodecReader * r = codec_open_read(path, &got_codec, 4096);
+    if (r == NULL) {
+        perror("fc_fuzz: codec_open_read");
+        abort();
+    }
+    char * got = malloc(want_len + 1);
+    int got_len = 0;
+    size_t n;
+    while ((n = codec_read(r, got + got_len, want_len + 1 - got_len)) > 0) {
+        got_len += n;
+        if (got_len == want_len + 1) {
+            break; // already too long
+        }
+    }
+    if (codec_close_read(r) == -1 || got_codec != codec ||
+        got_len != want_len || memcmp(got, want, want_len) != 0) {
+        fail(codec == CODEC_GZIP ? "fc_write (gzip)" : "fc_write");
+    }
+    free(want);
+    free(got);
+}
+
+/**
+ * Copy a model
+ *
+ * @param m the model to copy
+ * @param start the offset to start copying at
+ * @param len the number of characters to copy
+ * @return the copy
+ */
+static Model model_copy(Model * m, int start, int len) {
+    Model copy = {.data = malloc(len + 1), .len = len};
+    memcpy(copy.data, m->data + start, len);
+    copy.data[len] = '\0';
+    return copy;
+}
+
+/**
+ * Run one input: make the starting document, then make the edits to it and the model
+ *
+ * @param data the bytes of the input
+ * @param size the number of bytes
+ * @return 0 (any difference aborts)
+ */
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    Input in = {.data = data, .size = size, .at = 0};
+
+    // The starting document, with a few newlines in it
+    char start[FUZZ_MAX_START];
+    int start_len = next_byte(&in) % FUZZ_MAX_START;
+    for (int i = 0; i < start_len; i += 1) {
+        int b = next_byte(&in);
+        start[i] = (b % 5 == 0) ? '\n' : typed_char(b);
+    }
+    Model m = model_copy(&(Model) {.data = start, .len = start_len}, 0, start_len);
+    FileContents * fc = make_contents(start, start_len);
+    compare(fc, &m, "reading");
+
+    // The clipboard, and a snapshot that shares lines with the document
+    FileContents * clip = NULL;
+    Model clip_m = {.data = NULL, .len = 0};
+    FileContents * snap = NULL;
+    Model snap_m = {.data = NULL, .len = 0};
+
+    for (int edit = 0; edit < FUZZ_MAX_EDITS && in.at < in.size; edit += 1) {
+        int op = next_byte(&in) % 9;
+        const char * what = "nothing";
+
+        if (op == 0) {
+            // fc_insert puts the character before any character of the line (but not after the last one)
+            what = "fc_insert";
+            int y = pick_row(&in, &m);
+            int x = pick_col(&in, &m, y);
+            char c = typed_char(next_byte(&in));
+            int len;
+            int at = model_line(&m, y, &len);
+            if (at != -1 && x >= 0 && x <= len - 1) {
+                model_insert(&m, at + x, &c, 1);
+            }
+            fc_insert(fc, x, y, c);
+        } else if (op == 1) {
+            // fc_remove takes the character under the position, joining the lines on a newline
+            what = "fc_remove";
+            int y = pick_row(&in, &m);
+            int x = pick_col(&in, &m, y);
+            int len;
+            int at = model_line(&m, y, &len);
+            if (at != -1 && x >= 0 && x <= len - 1) {
+                model_erase(&m, at + x, 1);
+            }
+            fc_remove(fc, x, y);
+        } else if (op == 2) {
+            // fc_newline splits the line anywhere up to the end of its text
+            what = "fc_newline";
+            int y = pick_row(&in, &m);
+            int x = pick_col(&in, &m, y);
+            int len;
+            int at = model_line(&m, y, &len);
+            if (at != -1 && len > 0 && m.data[at + len - 1] == '\n') {
+                len -= 1;
+            }
+            if (at != -1 && x >= 0 && x <= len) {
+                model_insert(&m, at + x, "\n", 1);
+            }
+            fc_newline(fc, x, y);
+        } else if (op == 3) {
+            // fc_insert_batch inserts at every cursor fc_insert would, and moves them along
+            what = "fc_insert_batch";
+            CursorPos curs[FUZZ_MAX_CURSORS];
+            CursorPos expect[FUZZ_MAX_CURSORS];
+            int n = pick_cursors(&in, &m, curs);
+            char c = typed_char(next_byte(&in));
+            int expect_first = -1;
+            int expect_last = -1;
+            int row_count = 0;
+            for (int i = 0; i < n; i += 1) {
+                row_count = (i > 0 && curs[i].y == curs[i - 1].y) ? row_count : 0;
+                expect[i] = curs[i];
+                int len;
+                int at = model_line(&m, curs[i].y, &len);
+                if (at != -1 && curs[i].x >= 0 && curs[i].x <= len - 1) {
+                    row_count += 1;
+                    expect[i].x += row_count;
+                    expect_first = (expect_first == -1) ? curs[i].y : expect_first;
+                    expect_last = curs[i].y;
+                }
+            }
+            for (int i = n - 1; i >= 0; i -= 1) {
+                int len;
+                int at = model_line(&m, curs[i].y, &len);
+                if (at != -1 && curs[i].x >= 0 && curs[i].x <= len - 1) {
+                    model_insert(&m, at + curs[i].x, &c, 1);
+                }
+            }
+
+            int first;
+            int last;
+            fc_insert_batch(fc, curs, n, c, &first, &last);
+            if (first != expect_first || last != expect_last || memcmp(curs, expect, sizeof(CursorPos) * n) != 0) {
+                fail("fc_insert_batch (cursors)");
+            }
+        } else if (op == 4) {
+            // fc_remove_batch takes one character at (or before) each cursor, but never a newline
+            what = "fc_remove_batch";
+            CursorPos curs[FUZZ_MAX_CURSORS];
+            CursorPos expect[FUZZ_MAX_CURSORS];
+            int removed[FUZZ_MAX_CURSORS];
+            int n = pick_cursors(&in, &m, curs);
+            bool before = next_byte(&in) % 2;
+            int expect_first = -1;
+            int expect_last = -1;
+            int count = 0;
+            int row_first = 0; // where the removals on the current row start in removed
+            int prev = -1;     // the column of the last removal on the current row
+            for (int i = 0; i < n; i += 1) {
+                if (i == 0 || curs[i].y != curs[i - 1].y) {
+                    row_first = count;
+                    prev = -1;
+                }
+                int len;
+                int at = model_line(&m, curs[i].y, &len);
+                int r = curs[i].x - (before ? 1 : 0);
+                if (at != -1 && r >= 0 && r > prev && r < len && m.data[at + r] != '\n') {
+                    removed[count] = at + r;
+                    count += 1;
+                    prev = r;
+                    expect_first = (expect_first == -1) ? curs[i].y : expect_first;
+                    expect_last = curs[i].y;
+                }
+
+                // The cursor moves back by the characters taken out before it on its row
+                expect[i] = curs[i];
+                for (int j = row_first; j < count; j += 1) {
+                    if (removed[j] - at < curs[i].x) {
+                        expect[i].x -= 1;
+                    }
+                }
+            }
+            for (int i = count - 1; i >= 0; i -= 1) {
+                model_erase(&m, removed[i], 1);
+            }
+
+            int first;
+            int last;
+            fc_remove_batch(fc, curs, n, before, &first, &last);
+            if (first != expect_first || last != expect_last || memcmp(curs, expect, sizeof(CursorPos) * n) != 0) {
+                fail("fc_remove_batch (cursors)");
+            }
+        } else if (op == 5) {
+            // fc_copy takes a region into the clipboard, and fc_delete_range cuts it
+            what = "fc_copy";
+            CursorPos a = {.y = pick_row(&in, &m)};
+            a.x = pick_col(&in, &m, a.y);
+            CursorPos b = {.y = pick_row(&in, &m)};
+            b.x = pick_col(&in, &m, b.y);
+            bool cut = next_byte(&in) % 2;
+
+            CursorPos start = model_clamp(&m, a);
+            CursorPos end = model_clamp(&m, b);
+            CursorPos got_start = clamp_pos(fc, a);
+            CursorPos got_end = clamp_pos(fc, b);
+            if (cursor_cmp(&start, &got_start) != 0 || cursor_cmp(&end, &got_end) != 0) {
+                fail("clamp_pos");
+            }
+            if (cursor_cmp(&start, &end) > 0) {
+                CursorPos temp = start;
+                start = end;
+                end = temp;
+            }
+
+            int len;
+            int from = model_line(&m, start.y, &len) + start.x;
+            int to = model_line(&m, end.y, &len) + end.x;
+            if (clip != NULL) {
+                fc_cleanup(clip);
+                free(clip_m.data);
+            }
+            clip = fc_copy(fc, start, end);
+            clip_m = model_copy(&m, from, to - from);
+            compare(clip, &clip_m, "fc_copy (clipboard)");
+
+            if (cut) {
+                what = "fc_delete_range";
+                fc_delete_range(fc, start, end);
+                model_erase(&m, from, to - from);
+            }
+        } else if (op == 6) {
+            // fc_paste puts the clipboard in and leaves the position after it
+            what = "fc_paste";
+            if (clip != NULL) {
+                CursorPos a = {.y = pick_row(&in, &m)};
+                a.x = pick_col(&in, &m, a.y);
+                CursorPos at = model_clamp(&m, a);
+
+                int len;
+                int offset = model_line(&m, at.y, &len) + at.x;
+                model_insert(&m, offset, clip_m.data, clip_m.len);
+                CursorPos expect = model_pos(&m, offset + clip_m.len);
+
+                fc_paste(fc, &at, clip);
+                if (cursor_cmp(&at, &expect) != 0) {
+                    fail("fc_paste (position)");
+                }
+            }
+        } else if (op == 7) {
+            // fc_write puts the line endings and byte order mark back, and compresses
+            // (only every fourth save is compressed, because setting up zlib is slow)
+            what = "fc_write";
+            int how = next_byte(&in);
+            check_save(fc, &m, (how & 12) == 12 ? CODEC_GZIP : CODEC_NONE, how & 1, how & 2);
+        } else {
+            // Share every line with a snapshot, which edits after this must not change
+            what = "sharing";
+            if (snap != NULL) {
+                fc_cleanup(snap);
+                free(snap_m.data);
+            }
+            snap = share_contents(fc);
+            snap_m = model_copy(&m, 0, m.len);
+        }
+
+        compare(fc, &m, what);
+        if (clip != NULL) {
+            compare(clip, &clip_m, "an edit (clipboard)");
+        }
+        if (snap != NULL) {
+            compare(snap, &snap_m, "an edit (snapshot)");
+        }
+    }
+
+    fc_cleanup(fc);
+    free(m.data);
+    if (clip != NULL) {
+        fc_cleanup(clip);
+        free(clip_m.data);
+    }
+    if (snap != NULL) {
+        fc_cleanup(snap);
+        free(snap_m.data);
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+/**
+ * Run the inputs named on the command line, or make up random ones (-runs=N of them)
+ */
+int main(int argc, char * argv[]) {
+    long runs = 10000;
+    int files = 0;
+    for (int i = 1; i < argc; i += 1) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = atol(argv[i] + 6);
+            continue;
+        }
+
+        FILE * fp = fopen(argv[i], "rb");
+        if (fp == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        uint8_t buf[1 << 16];
+        size_t got = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, got);
+        files += 1;
+    }
+    if (files > 0) {
+        printf("fc_fuzz: %d inputs passed\n", files);
+        return EXIT_SUCCESS;
+    }
+
+    // The same inputs every time, so a failure can be run again
+    srand(1);
+    uint8_t buf[1024];
+    for (long run = 0; run < runs; run += 1) {
+        size_t size = rand() % sizeof(buf);
+        for (size_t i = 0; i < size; i += 1) {
+            buf[i] = rand() % 256;
+        }
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+    printf("fc_fuzz: %ld random inputs passed\n", runs);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Plays random replay scripts through a sanitize build of Delta (see make check),
+# stopping at the first one that crashes, trips fc_check or hangs. The scripts
+# are made from the run number, so a failure can be made again.
+#
+# Every script is also played on a copy of the file saved another way (CRLF
+# line endings, a byte order mark or gzip), and what that copy ends up holding
+# has to be the plain file's result, saved that same way.
+#
+# usage: sh fuzz/replay.sh DELTA RUNS
+#
+# @author Connor Henley, @thatging3rkid
+
+delta=$1
+runs=$2
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Every key there is a binding for, but exit (the script running out does that)
+keys="UP DOWN LEFT RIGHT NPAGE PPAGE HOME END SUP SDOWN BACKSPACE DC ENTER TAB ESC CTRL-B CTRL-F CTRL-C CTRL-X CTRL-V CTRL-L CTRL-S"
+text='int main() {\n\tint a = 1;\n\treturn a;\n}\n\nabc abc\nlast'
+cr=$(printf '\r')
+
+# Compressed files aren't scanned for their indentation, so make Tab do the same thing in every copy
+printf 'tab = tabs\n' > "$dir/.deltarc"
+
+# Stop with the script that failed
+fail() {
+    cp "$dir/script.keys" fuzz/replay-failure.keys
+    cat "$dir/err.txt"
+    echo "replay.sh: run $run $1, its script is in fuzz/replay-failure.keys"
+    exit 1
+}
+
+# Play the script on a file
+play() {
+    HOME="$dir" TERM=xterm timeout 20 "$delta" --replay "$dir/script.keys" "$1" > /dev/null 2> "$dir/err.txt"
+}
+
+for run in $(seq "$runs"); do
+    awk -v seed="$run" -v keys="$keys" 'BEGIN {
+        srand(seed)
+        n = split(keys, k, " ")
+        for (i = 0; i < 60; i += 1) {
+            if (rand() < 0.3) {
+                printf "type %s\n", substr("abc a\tb", 1 + int(rand() * 6), 1 + int(rand() * 3))
+            } else {
+                printf "key %s %d\n", k[1 + int(rand() * n)], 1 + int(rand() * 3)
+            }
+        }
+    }' > "$dir/script.keys"
+
+    printf "$text" > "$dir/file.txt"
+    play "$dir/file.txt" || fail "failed"
+
+    # The typed text never has a carriage return in it, so every one in the copy is from a save
+    case $((run % 3)) in
+    0)
+        printf "$text" | sed "s/\$/$cr/" | head -c -1 > "$dir/copy.txt"
+        play "$dir/copy.txt" || fail "failed on the CRLF copy"
+        [ "$(grep -c "$cr\$" "$dir/copy.txt")" -eq "$(tr -cd '\n' < "$dir/copy.txt" | wc -c)" ] &&
+            tr -d '\r' < "$dir/copy.txt" | cmp -s - "$dir/file.txt" || fail "saved the CRLF copy wrong"
+        ;;
+    1)
+        printf "\357\273\277$text" > "$dir/copy.txt"
+        play "$dir/copy.txt" || fail "failed on the byte order mark copy"
+        [ "$(head -c 3 "$dir/copy.txt")" = "$(printf '\357\273\277')" ] &&
+            tail -c +4 "$dir/copy.txt" | cmp -s - "$dir/file.txt" || fail "saved the byte order mark copy wrong"
+        ;;
+    2)
+        printf "$text" | gzip > "$dir/copy.txt.gz"
+        play "$dir/copy.txt.gz" || fail "failed on the gzip copy"
+        gzip -dc "$dir/copy.txt.gz" 2> /dev/null | cmp -s - "$dir/file.txt" || fail "saved the gzip copy wrong"
+        ;;
+    esac
+done
+echo "replay.sh: $runs random replay scripts passed"
@@ -0,0 +1,470 @@
+/**
+ * codec.c
+ *
+ * Transparent reading and writing of compressed files. gzip is handled with
+ * zlib, zstd is handed off to the zstd(1) tool through a pipe.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+
+#include "codec.h"
+
+// Size of a block handed to one compression thread
+#define CODEC_BLOCK (1 << 20)
+// Upper limit on the number of compression threads
+#define CODEC_MAX_THREADS 16
+
+struct CodecReader {
+    Codec codec;
+    FILE * fp;
+    gzFile gz;
+    pid_t child;
+};
+
+struct CodecWriter {
+    Codec codec;
+    FILE * fp;
+    pid_t child;
+    bool wrote_member;
+    int threads;
+    int filled;
+    char * blocks[CODEC_MAX_THREADS];
+    size_t lens[CODEC_MAX_THREADS];
+};
+
+typedef struct {
+    const char * in;
+    size_t in_len;
+    unsigned char * out;
+    size_t out_len;
+    bool ok;
+} GzipJob;
+
+/**
+ * Start the zstd tool with one end of a pipe attached to it
+ *
+ * @param argv the arguments to run zstd with
+ * @param child_fd the fd in the child the pipe replaces (0 or 1)
+ * @param other_fd an fd the child gets as its other standard stream, or -1 to leave it alone
+ * @param child set to the pid of the child
+ * @return the parent's end of the pipe, or -1 with errno set
+ */
+static int spawn_zstd(char * const argv[], int child_fd, int other_fd, pid_t * child) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+
+    // The parent reads from fds[0] when the child writes to stdout, and vice-versa
+    int parent_end = (child_fd == STDOUT_FILENO) ? fds[0] : fds[1];
+    int child_end = (child_fd == STDOUT_FILENO) ? fds[1] : fds[0];
+
+    // A close-on-exec pipe tells the parent whether the exec worked
+    int status_fds[2];
+    if (pipe(status_fds) == -1) {
+        int errsv = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = errsv;
+        return -1;
+    }
+    fcntl(status_fds[1], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        int errsv = errno;
+        close(fds[0]);
+        close(fds[1]);
+        close(status_fds[0]);
+        close(status_fds[1]);
+        errno = errsv;
+        return -1;
+    }
+
+    if (pid == 0) {
+        // zstd should still die quietly when its reader goes away
+        signal(SIGPIPE, SIG_DFL);
+        dup2(child_end, child_fd);
+        if (other_fd != -1) {
+            dup2(other_fd, (child_fd == STDOUT_FILENO) ? STDIN_FILENO : STDOUT_FILENO);
+            close(other_fd);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        close(status_fds[0]);
+        execvp(argv[0], argv);
+        int errsv = errno;
+        ssize_t ignored = write(status_fds[1], &errsv, sizeof(errsv));
+        (void) ignored;
+        _exit(127);
+    }
+
+    close(child_end);
+    close(status_fds[1]);
+
+    // Nothing comes through the status pipe when zstd started
+    int exec_errno;
+    ssize_t got = read(status_fds[0], &exec_errno, sizeof(exec_errno));
+    close(status_fds[0]);
+    if (got == sizeof(exec_errno)) {
+        close(parent_end);
+        waitpid(pid, NULL, 0);
+        errno = exec_errno;
+        return -1;
+    }
+
+    *child = pid;
+    return parent_end;
+}
+
+/**
+ * Wait for the zstd tool to finish
+ *
+ * @param child the pid of the child
+ * @return 0 if zstd exited cleanly, otherwise -1 with errno set
+ */
+static int reap_zstd(pid_t child) {
+    int status;
+    while (waitpid(child, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        errno = ENOENT; // zstd is not installed
+    } else {
+        errno = EIO;
+    }
+    return -1;
+}
+
+/**
+ * @inheritDoc
+ */
+CodecReader * codec_open_read(const char * path, Codec * codec, size_t block) {
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    // Look at the magic bytes to figure out the format
+    unsigned char magic[4] = {0, 0, 0, 0};
+    size_t got = fread(magic, 1, sizeof(magic), fp);
+    if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        *codec = CODEC_GZIP;
+    } else if (got == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        *codec = CODEC_ZSTD;
+    } else {
+        *codec = CODEC_NONE;
+    }
+    fseek(fp, 0, SEEK_SET);
+
+    CodecReader * r = malloc(sizeof(CodecReader));
+    r->codec = *codec;
+    r->fp = NULL;
+    r->gz = NULL;
+    r->child = -1;
+
+    switch (r->codec) {
+    case CODEC_NONE:
+        r->fp = fp;
+        return r;
+    case CODEC_GZIP: ;
+        // zlib takes over the descriptor, so give it a copy of its own
+        int fd = dup(fileno(fp));
+        fclose(fp);
+        if (fd == -1 || (r->gz = gzdopen(fd, "rb")) == NULL) {
+            if (fd != -1) {
+                close(fd);
+            }
+            free(r);
+            errno = (errno == 0) ? ENOMEM : errno;
+            return NULL;
+        }
+        gzbuffer(r->gz, (block == 0) ? CODEC_BLOCK : block);
+        return r;
+    case CODEC_ZSTD: ;
+        fclose(fp);
+        char * argv[] = {"zstd", "-dcq", "--", (char *) path, NULL};
+        int out = spawn_zstd(argv, STDOUT_FILENO, -1, &r->child);
+        if (out == -1 || (r->fp = fdopen(out, "rb")) == NULL) {
+            int errsv = errno;
+            if (out != -1) {
+                close(out);
+                reap_zstd(r->child);
+            }
+            free(r);
+            errno = errsv;
+            return NULL;
+        }
+        return r;
+    }
+
+    fclose(fp);
+    free(r);
+    errno = EINVAL;
+    return NULL;
+}
+
+/**
+ * @inheritDoc
+ */
+size_t codec_read(CodecReader * r, char * buf, size_t len) {
+    if (r->codec == CODEC_GZIP) {
+        int got = gzread(r->gz, buf, len);
+        return (got < 0) ? 0 : (size_t) got;
+    }
+    return fread(buf, sizeof(char), len, r->fp);
+}
+
+/**
+ * @inheritDoc
+ */
+int codec_close_read(CodecReader * r) {
+    int result = 0;
+    int errsv = 0;
+
+    if (r->codec == CODEC_GZIP) {
+        int gzerr;
+        gzerror(r->gz, &gzerr);
+        if (gzerr != Z_OK && gzerr != Z_BUF_ERROR) {
+            result = -1;
+            errsv = EIO;
+        }
+        gzclose(r->gz);
+    } else {
+        if (ferror(r->fp)) {
+            result = -1;
+            errsv = EIO;
+        }
+        fclose(r->fp);
+        if (r->child != -1 && reap_zstd(r->child) == -1) {
+            result = -1;
+            errsv = errno;
+        }
+    }
+
+    free(r);
+    errno = errsv;
+    return result;
+}
+
+/**
+ * Compress a block into a self-contained gzip member
+ *
+ * @param arg a pointer to the GzipJob to run
+ */
+static void * gzip_block(void * arg) {
+    GzipJob * job = arg;
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    job->ok = false;
+    job->out = NULL;
+
+    // windowBits of 15 + 16 asks zlib for a gzip header and trailer
+    if (deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    uLong bound = deflateBound(&s, job->in_len);
+    job->out = malloc(bound);
+    if (job->out != NULL) {
+        s.next_in = (Bytef *) job->in;
+        s.avail_in = job->in_len;
+        s.next_out = job->out;
+        s.avail_out = bound;
+        if (deflate(&s, Z_FINISH) == Z_STREAM_END) {
+            job->out_len = s.total_out;
+            job->ok = true;
+        }
+    }
+
+    deflateEnd(&s);
+    return NULL;
+}
+
+/**
+ * Compress every buffered block in parallel and write them out in order
+ *
+ * Concatenated gzip members form a valid gzip file, so the blocks can be
+ * compressed independently of each other (like pigz does).
+ *
+ * @param w the writer
+ * @return 0 on success, otherwise -1 with errno set
+ */
+static int gzip_flush(CodecWriter * w) {
+    GzipJob jobs[CODEC_MAX_THREADS];
+    pthread_t tids[CODEC_MAX_THREADS];
+    bool started[CODEC_MAX_THREADS];
+
+    for (int i = 0; i < w->filled; i += 1) {
+        jobs[i].in = w->blocks[i];
+        jobs[i].in_len = w->lens[i];
+        started[i] = false;
+    }
+
+    // Hand all but the first block to worker threads, and do the first one here
+    for (int i = 1; i < w->filled; i += 1) {
+        started[i] = (pthread_create(&tids[i], NULL, gzip_block, &jobs[i]) == 0);
+        if (!started[i]) {
+            gzip_block(&jobs[i]);
+        }
+    }
+    if (w->filled > 0) {
+        gzip_block(&jobs[0]);
+    }
+
+    int result = 0;
+    for (int i = 0; i < w->filled; i += 1) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        if (result == 0) {
+            if (!jobs[i].ok) {
+                errno = ENOMEM;
+                result = -1;
+            } else if (fwrite(jobs[i].out, 1, jobs[i].out_len, w->fp) != jobs[i].out_len) {
+                result = -1;
+            }
+        }
+        free(jobs[i].out);
+        w->lens[i] = 0;
+    }
+
+    w->wrote_member = w->wrote_member || w->filled > 0;
+    w->filled = 0;
+    return result;
+}
+
+/**
+ * @inheritDoc
+ */
+CodecWriter * codec_open_write(int fd, Codec codec) {
+    CodecWriter * w = malloc(sizeof(CodecWriter));
+    w->codec = codec;
+    w->fp = NULL;
+    w->child = -1;
+    w->wrote_member = false;
+    w->threads = 1;
+    w->filled = 0;
+
+    if (codec == CODEC_ZSTD) {
+        // If zstd exits early, writing to the pipe has to fail with EPIPE, not kill Delta
+        signal(SIGPIPE, SIG_IGN);
+
+        // Let zstd use every core for the compression (-T0), writing into fd
+        char * argv[] = {"zstd", "-qc", "-T0", NULL};
+        int in = spawn_zstd(argv, STDIN_FILENO, fd, &w->child);
+        int errsv = errno;
+        close(fd); // zstd has its own copy now
+        if (in == -1 || (w->fp = fdopen(in, "wb")) == NULL) {
+            errsv = (in == -1) ? errsv : errno;
+            if (in != -1) {
+                close(in);
+                reap_zstd(w->child);
+            }
+            free(w);
+            errno = errsv;
+            return NULL;
+        }
+        return w;
+    }
+
+    w->fp = fdopen(fd, "wb");
+    if (w->fp == NULL) {
+        int errsv = errno;
+        close(fd);
+        free(w);
+        errno = errsv;
+        return NULL;
+    }
+
+    if (codec == CODEC_GZIP) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        w->threads = (cpus < 1) ? 1 : (cpus > CODEC_MAX_THREADS ? CODEC_MAX_THREADS : (int) cpus);
+        for (int i = 0; i < w->threads; i += 1) {
+            w->blocks[i] = malloc(CODEC_BLOCK);
+            w->lens[i] = 0;
+        }
+    }
+    return w;
+}
+
+/**
+ * @inheritDoc
+ */
+int codec_write(CodecWriter * w, const char * buf, size_t len) {
+    if (w->codec != CODEC_GZIP) {
+        return (fwrite(buf, sizeof(char), len, w->fp) == len) ? 0 : -1;
+    }
+
+    // Fill up the blocks, compressing them once there is one for every thread
+    while (len > 0) {
+        size_t room = CODEC_BLOCK - w->lens[w->filled];
+        size_t take = (len < room) ? len : room;
+        memcpy(w->blocks[w->filled] + w->lens[w->filled], buf, take);
+        w->lens[w->filled] += take;
+        buf += take;
+        len -= take;
+
+        if (w->lens[w->filled] == CODEC_BLOCK) {
+            w->filled += 1;
+            if (w->filled == w->threads && gzip_flush(w) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @inheritDoc
+ */
+int codec_close_write(CodecWriter * w) {
+    int result = 0;
+    int errsv = 0;
+
+    if (w->codec == CODEC_GZIP) {
+        // Include the partial block, and make sure even an empty file gets a gzip header
+        if (w->lens[w->filled] > 0 || (!w->wrote_member && w->filled == 0)) {
+            w->filled += 1;
+        }
+        if (gzip_flush(w) == -1) {
+            result = -1;
+            errsv = errno;
+        }
+        for (int i = 0; i < w->threads; i += 1) {
+            free(w->blocks[i]);
+        }
+    }
+
+    if (fclose(w->fp) == EOF && result == 0) {
+        result = -1;
+        errsv = errno;
+    }
+    if (w->child != -1 && reap_zstd(w->child) == -1 && result == 0) {
+        result = -1;
+        errsv = errno;
+    }
+
+    free(w);
+    errno = errsv;
+    return result;
+}
@@ -0,0 +1,96 @@
+/**
+ * codec.h
+ *
+ * Transparent reading and writing of compressed files.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#ifndef CODEC_LIB
+#define CODEC_LIB
+
+#include <stddef.h>
+
+/**
+ * The compression formats Delta knows about
+ */
+typedef enum {
+    CODEC_NONE,
+    CODEC_GZIP,
+    CODEC_ZSTD
+} Codec;
+
+/**
+ * A stream that decompresses a file block-by-block
+ */
+typedef struct CodecReader CodecReader;
+
+/**
+ * A stream that compresses data into a file
+ */
+typedef struct CodecWriter CodecWriter;
+
+/**
+ * Open a file for reading, detecting the compression from its magic bytes
+ *
+ * @param path the location of the file
+ * @param codec set to the compression format of the file
+ * @param block how much gzip decompresses at a time, 0 for a size that suits
+ *              reading the whole file (set it to the read size when only the
+ *              start of the file is wanted)
+ * @return a reader, or NULL with errno set if the file could not be opened
+ *
+ * @note the returned reader must be closed using codec_close_read
+ */
+CodecReader * codec_open_read(const char * path, Codec * codec, size_t block);
+
+/**
+ * Read the next block of decompressed data
+ *
+ * @param r the reader (given by codec_open_read())
+ * @param buf where to put the data
+ * @param len the size of buf
+ * @return the number of bytes read, 0 at the end of the file or on an error
+ */
+size_t codec_read(CodecReader * r, char * buf, size_t len);
+
+/**
+ * Close a reader
+ *
+ * @param r the reader (given by codec_open_read())
+ * @return 0 if the whole file was read correctly, otherwise -1 with errno set
+ */
+int codec_close_read(CodecReader * r);
+
+/**
+ * Start writing into an open file, compressing everything written to it
+ *
+ * @param fd the file to write into, which the writer takes over (and closes
+ *           right away if it can't be opened)
+ * @param codec the compression format to use
+ * @return a writer, or NULL with errno set if the writer could not be opened
+ *
+ * @note gzip output is compressed in parallel blocks, one per processor
+ * @note opening a zstd writer ignores SIGPIPE for the whole process
+ * @note the returned writer must be closed using codec_close_write
+ */
+CodecWriter * codec_open_write(int fd, Codec codec);
+
+/**
+ * Write data into a writer
+ *
+ * @param w the writer (given by codec_open_write())
+ * @param buf the data to write
+ * @param len the number of bytes in buf
+ * @return 0 on success, otherwise -1 with errno set
+ */
+int codec_write(CodecWriter * w, const char * buf, size_t len);
+
+/**
+ * Flush and close a writer
+ *
+ * @param w the writer (given by codec_open_write())
+ * @return 0 if everything reached the file, otherwise -1 with errno set
+ */
+int codec_close_write(CodecWriter * w);
+
+#endif
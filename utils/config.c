@@ -0,0 +1,418 @@
+/**
+ * config.c
+ *
+ * Reads the settings, key bindings and colors in ~/.deltarc.
+ *
+ * The file has one setting per line, and # starts a comment:
+ *
+ *     tab = auto              (or tabs, or a number of spaces)
+ *     page_jump = 60
+ *     autosave = 0
+ *     window_budget = 256
+ *     color status = black cyan
+ *     bind CTRL-Q = exit
+ *
+ * Once a file has been parsed, the Config is written out to a cache along with
+ * the file's modification time, so the next start only has to read it back in.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <ncurses.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "string_utils.h"
+
+// The largest value each number setting can have
+#define MAX_TAB_WIDTH 16
+#define MAX_PAGE_JUMP 10000
+#define MAX_AUTOSAVE 86400
+#define MAX_WINDOW_BUDGET (1 << 20)
+
+/**
+ * What's at the start of a cache file, to tell if it still matches the config file
+ */
+typedef struct {
+    char magic[8];
+    int version;
+    int config_len;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+} CacheHeader;
+
+static const char * action_names[ACT_COUNT] = {
+    [ACT_NONE] = "none", [ACT_INSERT] = "insert", [ACT_LEFT] = "left", [ACT_RIGHT] = "right",
+    [ACT_UP] = "up", [ACT_DOWN] = "down", [ACT_PAGE_UP] = "page_up", [ACT_PAGE_DOWN] = "page_down",
+    [ACT_CURSOR_UP] = "cursor_up", [ACT_CURSOR_DOWN] = "cursor_down", [ACT_ESCAPE] = "escape",
+    [ACT_FIND] = "find", [ACT_MARK] = "mark", [ACT_COPY] = "copy", [ACT_CUT] = "cut",
+    [ACT_PASTE] = "paste", [ACT_BACKSPACE] = "backspace", [ACT_DELETE] = "delete",
+    [ACT_NEWLINE] = "newline", [ACT_TAB] = "tab", [ACT_SAVE] = "save", [ACT_EXIT] = "exit",
+    [ACT_COLUMN] = "column"
+};
+
+static const char * color_names[] = {
+    "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white"
+};
+
+static const char * pair_names[PAIR_COUNT] = {
+    [PAIR_HEADER] = "header", [PAIR_STATUS] = "status", [PAIR_ERROR] = "error"
+};
+
+/**
+ * Look up a name in a table of names
+ *
+ * @param names the table
+ * @param len the number of names in the table
+ * @param name the name to look for
+ * @return the index of the name, or -1 if it isn't there
+ */
+static int find_name(const char ** names, int len, const char * name) {
+    for (int i = 0; i < len; i += 1) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse a whole number
+ *
+ * @param input the string the number is in (decimal, or hex starting with 0x)
+ * @param output set to the number
+ * @return true if input was a number and nothing else
+ */
+static bool parse_number(char * input, long * output) {
+    // strtol would also skip spaces and take a sign, which a setting can't have
+    if (!isdigit((unsigned char) input[0])) {
+        return false;
+    }
+
+    char * end;
+    errno = 0;
+    long number = strtol(input, &end, (strncmp(input, "0x", 2) == 0) ? 16 : 10);
+    if (*end != '\0' || errno == ERANGE) {
+        return false;
+    }
+    *output = number;
+    return true;
+}
+
+/**
+ * Make a trimmed copy of part of a string
+ *
+ * @param start the first character
+ * @param len the number of characters
+ * @return the trimmed copy
+ *
+ * @note the returned string must be freed
+ */
+static char * trim_copy(const char * start, int len) {
+    char * copy = malloc(sizeof(char) * (len + 1));
+    memcpy(copy, start, len);
+    copy[len] = '\0';
+    return str_trim(copy);
+}
+
+/**
+ * Apply one setting
+ *
+ * @param config the Config to change
+ * @param name the left side of the =
+ * @param value the right side of the =
+ * @return NULL on success, otherwise a description of the problem
+ */
+static const char * config_set(Config * config, char * name, char * value) {
+    long number;
+
+    if (strcmp(name, "tab") == 0) {
+        if (strcmp(value, "auto") == 0) {
+            config->tab_width = 0;
+        } else if (strcmp(value, "tabs") == 0) {
+            config->tab_width = -1;
+        } else if (parse_number(value, &number) && number > 0 && number <= MAX_TAB_WIDTH) {
+            config->tab_width = (int) number;
+        } else {
+            return "tab should be auto, tabs or 1 to 16";
+        }
+    } else if (strcmp(name, "page_jump") == 0) {
+        if (!parse_number(value, &number) || number <= 0 || number > MAX_PAGE_JUMP) {
+            return "page_jump should be a number of lines";
+        }
+        config->page_jump = (int) number;
+    } else if (strcmp(name, "autosave") == 0) {
+        if (!parse_number(value, &number) || number > MAX_AUTOSAVE) {
+            return "autosave should be a number of seconds";
+        }
+        config->autosave = (int) number;
+    } else if (strcmp(name, "window_budget") == 0) {
+        if (!parse_number(value, &number) || number <= 0 || number > MAX_WINDOW_BUDGET) {
+            return "window_budget should be a number of megabytes";
+        }
+        config->window_budget = (int) number;
+    } else if (strncmp(name, "color ", 6) == 0) {
+        char * slot = trim_copy(name + 6, strlen(name + 6));
+        int pair = find_name(pair_names, PAIR_COUNT, slot);
+        free(slot);
+
+        char fg[16];
+        char bg[16];
+        int colors = sizeof(color_names) / sizeof(color_names[0]);
+        if (pair == -1) {
+            return "colors are header, status or error";
+        } else if (sscanf(value, "%15s %15s", fg, bg) != 2 ||
+                   find_name(color_names, colors, fg) == -1 || find_name(color_names, colors, bg) == -1) {
+            return "a color should be a foreground and a background";
+        }
+        config->colors[pair][0] = find_name(color_names, colors, fg);
+        config->colors[pair][1] = find_name(color_names, colors, bg);
+    } else if (strncmp(name, "bind ", 5) == 0) {
+        char * key_name = trim_copy(name + 5, strlen(name + 5));
+        int key = config_key(key_name);
+        free(key_name);
+
+        int action = find_name(action_names, ACT_COUNT, value);
+        if (key < 0 || key >= CONFIG_KEYS) {
+            return "unknown key";
+        } else if (action == -1) {
+            return "unknown action";
+        }
+        config->keys[key] = action;
+    } else {
+        return "unknown setting";
+    }
+    return NULL;
+}
+
+/**
+ * Check that every value in a Config is one config_set() could have given it
+ *
+ * @param config the Config to check
+ * @return true if the Config is safe to use
+ */
+static bool config_valid(const Config * config) {
+    int colors = sizeof(color_names) / sizeof(color_names[0]);
+    if (config->tab_width < -1 || config->tab_width > MAX_TAB_WIDTH ||
+        config->page_jump <= 0 || config->page_jump > MAX_PAGE_JUMP ||
+        config->autosave < 0 || config->autosave > MAX_AUTOSAVE ||
+        config->window_budget <= 0 || config->window_budget > MAX_WINDOW_BUDGET) {
+        return false;
+    }
+    for (int i = 0; i < PAIR_COUNT; i += 1) {
+        for (int j = 0; j < 2; j += 1) {
+            if (config->colors[i][j] < 0 || config->colors[i][j] >= colors) {
+                return false;
+            }
+        }
+    }
+    for (int i = 0; i < CONFIG_KEYS; i += 1) {
+        if (config->keys[i] >= ACT_COUNT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @inheritDoc
+ */
+void config_defaults(Config * config) {
+    memset(config, 0, sizeof(Config));
+    config->tab_width = 0;
+    config->page_jump = 60;
+    config->autosave = 0;
+    config->window_budget = 256;
+
+    config->colors[PAIR_HEADER][0] = COLOR_BLACK;
+    config->colors[PAIR_HEADER][1] = COLOR_WHITE;
+    config->colors[PAIR_STATUS][0] = COLOR_BLACK;
+    config->colors[PAIR_STATUS][1] = COLOR_CYAN;
+    config->colors[PAIR_ERROR][0] = COLOR_RED;
+    config->colors[PAIR_ERROR][1] = COLOR_CYAN;
+
+    for (int i = 32; i <= 126; i += 1) {
+        config->keys[i] = ACT_INSERT;
+    }
+    config->keys[KEY_LEFT] = ACT_LEFT;
+    config->keys[KEY_RIGHT] = ACT_RIGHT;
+    config->keys[KEY_UP] = ACT_UP;
+    config->keys[KEY_DOWN] = ACT_DOWN;
+    config->keys[KEY_PPAGE] = ACT_PAGE_UP;
+    config->keys[KEY_NPAGE] = ACT_PAGE_DOWN;
+    config->keys[KEY_SR] = ACT_CURSOR_UP;
+    config->keys[KEY_SF] = ACT_CURSOR_DOWN;
+    config->keys[27] = ACT_ESCAPE;
+    config->keys[6] = ACT_FIND;        // ctrl+f
+    config->keys[2] = ACT_MARK;        // ctrl+b
+    config->keys[3] = ACT_COPY;        // ctrl+c
+    config->keys[24] = ACT_CUT;        // ctrl+x
+    config->keys[22] = ACT_PASTE;      // ctrl+v
+    config->keys[KEY_BACKSPACE] = ACT_BACKSPACE;
+    config->keys[KEY_DC] = ACT_DELETE;
+    config->keys['\n'] = ACT_NEWLINE;
+    config->keys['\t'] = ACT_TAB;
+    config->keys[19] = ACT_SAVE;       // ctrl+s
+    config->keys[5] = ACT_EXIT;        // ctrl+e
+    config->keys[12] = ACT_COLUMN;     // ctrl+l
+}
+
+/**
+ * @inheritDoc
+ */
+int config_parse(FILE * file, Config * config, char * error, int error_len) {
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num += 1;
+
+        // Drop the comment and the newline
+        line[strcspn(line, "#\r\n")] = '\0';
+        char * equals = strchr(line, '=');
+        if (equals == NULL) {
+            char * rest = trim_copy(line, strlen(line));
+            bool blank = (rest[0] == '\0');
+            free(rest);
+            if (blank) {
+                continue;
+            }
+            snprintf(error, error_len, "line %d: expected name = value", line_num);
+            errno = EINVAL;
+            return -1;
+        }
+
+        char * name = trim_copy(line, equals - line);
+        char * value = trim_copy(equals + 1, strlen(equals + 1));
+        const char * problem = config_set(config, name, value);
+        free(name);
+        free(value);
+        if (problem != NULL) {
+            snprintf(error, error_len, "line %d: %s", line_num, problem);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (ferror(file)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @inheritDoc
+ */
+int config_load(const char * path, const char * cache_path, Config * config, char * error, int error_len) {
+    config_defaults(config);
+
+    struct stat info;
+    if (stat(path, &info) == -1) {
+        return -1;
+    }
+
+    // What the cache has to say to still be good
+    CacheHeader want;
+    memset(&want, 0, sizeof(CacheHeader));
+    memcpy(want.magic, "deltarc", 8);
+    want.version = CONFIG_VERSION;
+    want.config_len = sizeof(Config);
+    want.size = info.st_size;
+    want.mtime_sec = info.st_mtim.tv_sec;
+    want.mtime_nsec = info.st_mtim.tv_nsec;
+
+    // Use the cache if it's up to date, and hasn't been damaged since it was written
+    FILE * cache = fopen(cache_path, "rb");
+    if (cache != NULL) {
+        CacheHeader got;
+        Config cached;
+        bool hit = (fread(&got, sizeof(CacheHeader), 1, cache) == 1 &&
+                    memcmp(&got, &want, sizeof(CacheHeader)) == 0 &&
+                    fread(&cached, sizeof(Config), 1, cache) == 1 &&
+                    config_valid(&cached));
+        fclose(cache);
+        if (hit) {
+            memcpy(config, &cached, sizeof(Config));
+            return 0;
+        }
+    }
+
+    // Otherwise parse the file
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int result = config_parse(file, config, error, error_len);
+    int errsv = errno;
+    fclose(file);
+    if (result == -1) {
+        config_defaults(config);
+        errno = errsv;
+        return -1;
+    }
+
+    // Write the cache for next time (it's fine if that doesn't work). Every
+    // process gets its own temporary file, so starting a few at once is safe.
+    char * temp_name = malloc(strlen(cache_path) + 8);
+    sprintf(temp_name, "%s.XXXXXX", cache_path);
+    int fd = mkstemp(temp_name);
+    cache = (fd == -1) ? NULL : fdopen(fd, "wb");
+    if (cache != NULL) {
+        bool ok = (fwrite(&want, sizeof(CacheHeader), 1, cache) == 1 &&
+                   fwrite(config, sizeof(Config), 1, cache) == 1);
+        ok = (fclose(cache) == 0) && ok;
+        if (!ok || rename(temp_name, cache_path) == -1) {
+            remove(temp_name);
+        }
+    } else if (fd != -1) {
+        close(fd);
+        remove(temp_name);
+    }
+    free(temp_name);
+    return 0;
+}
+
+/**
+ * @inheritDoc
+ */
+int config_key(const char * name) {
+    static const struct {
+        char * name;
+        int code;
+    } keys[] = {
+        {"UP", KEY_UP}, {"DOWN", KEY_DOWN}, {"LEFT", KEY_LEFT}, {"RIGHT", KEY_RIGHT},
+        {"NPAGE", KEY_NPAGE}, {"PPAGE", KEY_PPAGE}, {"BACKSPACE", KEY_BACKSPACE},
+        {"DC", KEY_DC}, {"ENTER", '\n'}, {"TAB", '\t'}, {"ESC", 27},
+        {"SUP", KEY_SR}, {"SDOWN", KEY_SF}, {"HOME", KEY_HOME}, {"END", KEY_END},
+        {"SPACE", ' '}
+    };
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i += 1) {
+        if (strcmp(name, keys[i].name) == 0) {
+            return keys[i].code;
+        }
+    }
+    if (strncmp(name, "CTRL-", 5) == 0 && 'A' <= name[5] && name[5] <= 'Z' && name[6] == '\0') {
+        return name[5] - 'A' + 1;
+    }
+    if (name[0] == 'F' && name[1] != '\0') {
+        char * end;
+        long number = strtol(name + 1, &end, 10);
+        if (*end == '\0' && 1 <= number && number <= 12) {
+            return KEY_F(number);
+        }
+    }
+    if (32 < name[0] && name[0] <= 126 && name[1] == '\0') {
+        return name[0];
+    }
+    return -1;
+}
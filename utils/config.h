@@ -0,0 +1,110 @@
+/**
+ * config.h
+ *
+ * Reads the settings, key bindings and colors in ~/.deltarc.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#ifndef CONFIG_LIB
+#define CONFIG_LIB
+
+#include <stdio.h>
+
+// Enough room for every key code ncurses hands out (up to KEY_MAX)
+#define CONFIG_KEYS 512
+// Bumped whenever the Config layout or the defaults change, so old caches get thrown out
+#define CONFIG_VERSION 2
+
+/**
+ * The things a key can be bound to
+ */
+typedef enum {
+    ACT_NONE,
+    ACT_INSERT,
+    ACT_LEFT,
+    ACT_RIGHT,
+    ACT_UP,
+    ACT_DOWN,
+    ACT_PAGE_UP,
+    ACT_PAGE_DOWN,
+    ACT_CURSOR_UP,
+    ACT_CURSOR_DOWN,
+    ACT_ESCAPE,
+    ACT_FIND,
+    ACT_MARK,
+    ACT_COPY,
+    ACT_CUT,
+    ACT_PASTE,
+    ACT_BACKSPACE,
+    ACT_DELETE,
+    ACT_NEWLINE,
+    ACT_TAB,
+    ACT_SAVE,
+    ACT_EXIT,
+    ACT_COLUMN,
+    ACT_COUNT
+} Action;
+
+/**
+ * The colors the editor draws with (the ncurses color pair for each is one higher)
+ */
+typedef enum {
+    PAIR_HEADER,
+    PAIR_STATUS,
+    PAIR_ERROR,
+    PAIR_COUNT
+} ColorPair;
+
+/**
+ * Everything that can be set in the config file
+ *
+ * @note this is written to the cache as-is, so it can't hold any pointers
+ */
+typedef struct {
+    int tab_width;      // -1 to insert tabs, 0 to follow the file, otherwise a number of spaces
+    int page_jump;      // the number of lines page up and page down move
+    int autosave;       // seconds between saves, 0 to only save on ctrl+s
+    int window_budget;  // megabytes
+    short colors[PAIR_COUNT][2];        // the foreground and background of each ColorPair
+    unsigned char keys[CONFIG_KEYS];    // the Action bound to each key code
+} Config;
+
+/**
+ * Fill in a Config with the built-in settings and key bindings
+ *
+ * @param config the Config to fill in
+ */
+void config_defaults(Config * config);
+
+/**
+ * Load a config file, using the cached copy if the file hasn't changed since it was made
+ *
+ * @param path the location of the config file
+ * @param cache_path the location of the cache, which is rewritten when it's out of date
+ * @param config filled in with the defaults and then the settings in the file
+ * @param error set to a description of the problem if the file has a mistake in it
+ * @param error_len the size of error
+ * @return 0 on success, otherwise -1 with errno set (EINVAL for a mistake in the file)
+ */
+int config_load(const char * path, const char * cache_path, Config * config, char * error, int error_len);
+
+/**
+ * Parse a config file
+ *
+ * @param file the file to read from
+ * @param config the Config to change
+ * @param error set to a description of the problem if the file has a mistake in it
+ * @param error_len the size of error
+ * @return 0 on success, otherwise -1 with errno set (EINVAL for a mistake in the file)
+ */
+int config_parse(FILE * file, Config * config, char * error, int error_len);
+
+/**
+ * Look up a key by name
+ *
+ * @param name the name of the key (like DOWN, CTRL-S or a single character)
+ * @return the key code, or -1 if there's no such key
+ */
+int config_key(const char * name);
+
+#endif
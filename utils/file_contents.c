@@ -0,0 +1,601 @@
+/**
+ * file_contents.c
+ *
+ * The document being edited. Lines are reference counted, so copying and
+ * pasting share them instead of copying bytes, and a line is only copied when
+ * something changes it while it's shared (see fc_own()).
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ncurses.h>
+
+#include "file_contents.h"
+
+/**
+ * @inheritDoc
+ */
+FileLine * make_line(char * head, int head_len, char * tail, int tail_len) {
+    FileLine * entry = malloc(sizeof(FileLine));
+    entry->refs = 1;
+    entry->len = head_len + tail_len + 1;
+    entry->data = malloc(sizeof(char) * entry->len);
+    if (entry->data == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    if (head_len > 0) {
+        memcpy(entry->data, head, head_len);
+    }
+    if (tail_len > 0) {
+        memcpy(entry->data + head_len, tail, tail_len);
+    }
+    entry->data[entry->len - 1] = '\0';
+    return entry;
+}
+
+/**
+ * @inheritDoc
+ */
+FileLine * fl_share(FileLine * line) {
+    line->refs += 1;
+    return line;
+}
+
+/**
+ * @inheritDoc
+ */
+void fl_release(FileLine * line) {
+    line->refs -= 1;
+    if (line->refs == 0) {
+        free(line->data);
+        free(line);
+    }
+}
+
+/**
+ * @inheritDoc
+ */
+FileLine * fc_own(FileContents * fc, int y) {
+    FileLine * line = fc->data[y];
+    if (line->refs > 1) {
+        fc->data[y] = make_line(line->data, line->len - 1, NULL, 0);
+        fl_release(line);
+    }
+    return fc->data[y];
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_replace(FileContents * fc, int y, char * data, int len) {
+    FileLine * line = fc->data[y];
+    if (line->refs > 1) {
+        fc->data[y] = malloc(sizeof(FileLine));
+        fc->data[y]->refs = 1;
+        fl_release(line);
+    } else {
+        free(line->data);
+    }
+    fc->data[y]->data = data;
+    fc->data[y]->len = len;
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_append(FileContents * fc, int * cap, FileLine * entry) {
+    if (fc->len == *cap) {
+        *cap = (*cap == 0) ? 64 : *cap * 2;
+        FileLine ** temp = realloc(fc->data, sizeof(FileLine *) * *cap);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        fc->data = temp;
+    }
+    fc->data[fc->len] = entry;
+    fc->len += 1;
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_cleanup(FileContents * fc) {
+    // Release all the FileLines, freeing the ones nothing else is using
+    for (int i = 0; i < fc->len; i += 1) {
+        fl_release(fc->data[i]);
+        fc->data[i] = NULL;
+    }
+
+    // Free the FileContents instance
+    free(fc->data);
+    free(fc);
+    fc = NULL;
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_insert(FileContents * fc, int x, int y, char ins_char) {
+    // Ensure the position is in-bounds
+    if (y < 0 || y >= fc->len || x < 0 || x > fc->data[y]->len - 2) {
+        return;
+    }
+
+    // Make the FileLine longer
+    fc_own(fc, y);
+    fc->data[y]->len += 1;
+    char * temp = realloc(fc->data[y]->data, fc->data[y]->len);
+    if (temp == NULL) {
+        fprintf(stderr, "delta: an error has occured\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    fc->data[y]->data = temp;
+
+    // Special case for an empty line (not a one character last line)
+    if (fc->data[y]->len == 3 && fc->data[y]->data[0] == '\n') {
+        fc->data[y]->data[0] = ins_char;
+        fc->data[y]->data[1] = '\n';
+        fc->data[y]->data[2] = '\0';
+        return;
+    }
+
+    // Start by copying all data after the insertion point into a temporary spot
+    char * temp_s = malloc(sizeof(char) * (fc->data[y]->len - x));
+    strncpy(temp_s, fc->data[y]->data + x, fc->data[y]->len - 1 - x);
+
+    // Then insert the character
+    fc->data[y]->data[x] = ins_char;
+
+    // Finally, copy the data back into the array, after the insertion point
+    // While this method may not be the fastest, it works.
+    strncpy(fc->data[y]->data + x + 1, temp_s, fc->data[y]->len - 1 - x);
+
+    // Cleanup memory used by the temporary storage
+    free(temp_s);
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_remove(FileContents * fc, int x, int y) {
+    if (y < 0 || y >= fc->len || x < 0 || x > fc->data[y]->len - 2) {
+        beep(); // for debugging right now, might become a feature
+        return;
+    }
+
+    // See if this is on a newline character (the last line doesn't have one)
+    if (fc->data[y]->data[x] == '\n') {
+        // There is no line after the last one to join with
+        if (y + 1 >= fc->len) {
+            beep();
+            return;
+        }
+
+        // Calculate the new length of the line
+        fc_own(fc, y);
+        int new_len = fc->data[y]->len + fc->data[y + 1]->len - 2;
+
+        // Make the storage for the data bigger
+        char * temp = realloc(fc->data[y]->data, new_len);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: an error has occured\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        fc->data[y]->data = temp;
+
+        // Move the data into the old string
+        strncpy(fc->data[y]->data + fc->data[y]->len - 2, fc->data[y + 1]->data, fc->data[y + 1]->len);
+        fc->data[y]->len = new_len;
+
+        // Release the old line
+        fl_release(fc->data[y + 1]);
+
+        // Decrease the length
+        fc->len -= 1;
+
+        // Move everything up a line
+        for (int i = y + 1; i < fc->len; i += 1) {
+            fc->data[i] = fc->data[i + 1];
+        }
+    } else {
+        // Make temorary space for the contents of the line
+        fc_own(fc, y);
+        char * temp_s = malloc(sizeof(char) * fc->data[y]->len);
+        strncpy(temp_s, fc->data[y]->data, fc->data[y]->len);
+
+        // Move the space for the string and make it one shorter
+        fc->data[y]->len -= 1;
+        char * temp = realloc(fc->data[y]->data, fc->data[y]->len);
+        if (temp == NULL) {
+            fprintf(stderr, "delta: an error has occured\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        fc->data[y]->data = temp;
+
+        // Move the data back into the string, overwriting the old character
+        x += 1;
+        strncpy(fc->data[y]->data, temp_s, x);
+        strncpy(fc->data[y]->data + x - 1, temp_s + x, fc->data[y]->len - x + 1);
+
+        // Free the temporary resources
+        free(temp_s);
+    }
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_newline(FileContents * fc, int x, int y) {
+    if (y < 0 || y >= fc->len || x < 0) {
+        return;
+    }
+
+    // The split can happen anywhere up to (and including) the end of the text
+    FileLine * line = fc->data[y];
+    int text_len = line->len - 1;
+    if (text_len > 0 && line->data[text_len - 1] == '\n') {
+        text_len -= 1;
+    }
+    if (x > text_len) {
+        return;
+    }
+
+    // Make room for one more line in the table
+    FileLine ** temp = realloc(fc->data, sizeof(FileLine *) * (fc->len + 1));
+    if (temp == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    fc->data = temp;
+    memmove(fc->data + y + 2, fc->data + y + 1, sizeof(FileLine *) * (fc->len - y - 1));
+    fc->len += 1;
+
+    // The text after the split (and the old line ending) moves to the new line
+    fc->data[y + 1] = make_line(line->data + x, line->len - 1 - x, NULL, 0);
+    fc->data[y] = make_line(line->data, x, "\n", 1);
+    fl_release(line);
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_insert_batch(FileContents * fc, CursorPos * curs, int n, char ins_char, int * first, int * last) {
+    *first = -1;
+    *last = -1;
+
+    for (int i = 0; i < n; ) {
+        int y = curs[i].y;
+        int end = i;
+        while (end < n && curs[end].y == y) {
+            end += 1;
+        }
+        if (y < 0 || y >= fc->len) {
+            i = end;
+            continue;
+        }
+
+        // Count the cursors that are in-bounds (the same rule as fc_insert)
+        FileLine * line = fc->data[y];
+        int count = 0;
+        for (int j = i; j < end; j += 1) {
+            if (curs[j].x >= 0 && curs[j].x <= line->len - 2) {
+                count += 1;
+            }
+        }
+        if (count == 0) {
+            i = end;
+            continue;
+        }
+
+        // Copy the line into its new storage, dropping the character in at each cursor
+        char * data = malloc(sizeof(char) * (line->len + count));
+        if (data == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        int from = 0;
+        int to = 0;
+        for (int j = i; j < end; j += 1) {
+            int x = curs[j].x;
+            if (x < 0 || x > line->len - 2) {
+                continue;
+            }
+            memcpy(data + to, line->data + from, x - from);
+            to += x - from;
+            data[to] = ins_char;
+            to += 1;
+            from = x;
+            curs[j].x = to;
+        }
+        memcpy(data + to, line->data + from, line->len - from);
+
+        fc_replace(fc, y, data, line->len + count);
+
+        *first = (*first == -1) ? y : *first;
+        *last = y;
+        i = end;
+    }
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_remove_batch(FileContents * fc, CursorPos * curs, int n, bool before, int * first, int * last) {
+    *first = -1;
+    *last = -1;
+
+    for (int i = 0; i < n; ) {
+        int y = curs[i].y;
+        int end = i;
+        while (end < n && curs[end].y == y) {
+            end += 1;
+        }
+        if (y < 0 || y >= fc->len) {
+            i = end;
+            continue;
+        }
+
+        // Slide the kept characters down over the removed ones, in place
+        FileLine * line = fc_own(fc, y);
+        int from = 0;
+        int to = 0;
+        int prev = -1;
+        for (int j = i; j < end; j += 1) {
+            int x = curs[j].x - (before ? 1 : 0);
+            bool removable = x >= 0 && x > prev && x < line->len - 1 && line->data[x] != '\n';
+            if (removable) {
+                memmove(line->data + to, line->data + from, x - from);
+                to += x - from;
+                from = x + 1;
+                prev = x;
+            }
+
+            // A delete takes the character under the cursor, which isn't before it
+            curs[j].x -= (from - to) - ((removable && !before) ? 1 : 0);
+        }
+        if (from == to) {
+            i = end;
+            continue;
+        }
+        memmove(line->data + to, line->data + from, line->len - from);
+        line->len -= from - to;
+
+        *first = (*first == -1) ? y : *first;
+        *last = y;
+        i = end;
+    }
+}
+
+/**
+ * @inheritDoc
+ */
+FileContents * fc_copy(FileContents * fc, CursorPos start, CursorPos end) {
+    FileContents * clip = malloc(sizeof(FileContents));
+    clip->len = end.y - start.y + 1;
+    clip->data = malloc(sizeof(FileLine *) * clip->len);
+
+    FileLine * first = fc->data[start.y];
+    FileLine * last = fc->data[end.y];
+    if (start.y == end.y) {
+        clip->data[0] = make_line(first->data + start.x, end.x - start.x, NULL, 0);
+        return clip;
+    }
+
+    if (start.x == 0) {
+        clip->data[0] = fl_share(first);
+    } else {
+        clip->data[0] = make_line(first->data + start.x, first->len - 1 - start.x, NULL, 0);
+    }
+    for (int y = start.y + 1; y < end.y; y += 1) {
+        clip->data[y - start.y] = fl_share(fc->data[y]);
+    }
+    clip->data[clip->len - 1] = make_line(last->data, end.x, NULL, 0);
+    return clip;
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_delete_range(FileContents * fc, CursorPos start, CursorPos end) {
+    FileLine * first = fc->data[start.y];
+    FileLine * last = fc->data[end.y];
+    FileLine * joined = make_line(first->data, start.x, last->data + end.x, last->len - 1 - end.x);
+
+    for (int y = start.y; y <= end.y; y += 1) {
+        fl_release(fc->data[y]);
+    }
+    fc->data[start.y] = joined;
+
+    // Move everything after the region up
+    memmove(fc->data + start.y + 1, fc->data + end.y + 1, sizeof(FileLine *) * (fc->len - end.y - 1));
+    fc->len -= end.y - start.y;
+}
+
+/**
+ * @inheritDoc
+ */
+void fc_paste(FileContents * fc, CursorPos * at, FileContents * clip) {
+    FileLine * line = fc->data[at->y];
+    FileLine * clip_first = clip->data[0];
+    FileLine * clip_last = clip->data[clip->len - 1];
+
+    if (clip->len == 1) {
+        // The region goes into the middle of the line at the cursor
+        int clip_len = clip_first->len - 1;
+        char * data = malloc(sizeof(char) * (line->len + clip_len));
+        if (data == NULL) {
+            fprintf(stderr, "delta: error allocating memory, exiting\n");
+            endwin();
+            exit(EXIT_FAILURE);
+        }
+        memcpy(data, line->data, at->x);
+        memcpy(data + at->x, clip_first->data, clip_len);
+        memcpy(data + at->x + clip_len, line->data + at->x, line->len - at->x);
+        fc_replace(fc, at->y, data, line->len + clip_len);
+        at->x += clip_len;
+        return;
+    }
+
+    // Make room in the line table for the new lines
+    int added = clip->len - 1;
+    FileLine ** temp = realloc(fc->data, sizeof(FileLine *) * (fc->len + added));
+    if (temp == NULL) {
+        fprintf(stderr, "delta: error allocating memory, exiting\n");
+        endwin();
+        exit(EXIT_FAILURE);
+    }
+    fc->data = temp;
+    memmove(fc->data + at->y + 1 + added, fc->data + at->y + 1, sizeof(FileLine *) * (fc->len - at->y - 1));
+    fc->len += added;
+
+    // Split the line at the cursor around the region
+    FileLine * head = make_line(line->data, at->x, clip_first->data, clip_first->len - 1);
+    FileLine * tail = make_line(clip_last->data, clip_last->len - 1, line->data + at->x, line->len - 1 - at->x);
+    fl_release(line);
+
+    fc->data[at->y] = head;
+    for (int i = 1; i < clip->len - 1; i += 1) {
+        fc->data[at->y + i] = fl_share(clip->data[i]);
+    }
+    fc->data[at->y + added] = tail;
+
+    at->y += added;
+    at->x = clip_last->len - 1;
+}
+
+/**
+ * @inheritDoc
+ */
+int cursor_cmp(const void * a, const void * b) {
+    const CursorPos * left = a;
+    const CursorPos * right = b;
+    if (left->y != right->y) {
+        return (left->y < right->y) ? -1 : 1;
+    }
+    return (left->x > right->x) - (left->x < right->x);
+}
+
+/**
+ * @inheritDoc
+ */
+CursorPos clamp_pos(FileContents * fc, CursorPos p) {
+    p.y = (p.y < 0) ? 0 : (p.y >= fc->len ? fc->len - 1 : p.y);
+
+    // The furthest a cursor can go is onto the newline, or past the end if there isn't one
+    FileLine * line = fc->data[p.y];
+    int max_x = line->len - 1;
+    if (max_x > 0 && line->data[max_x - 1] == '\n') {
+        max_x -= 1;
+    }
+    p.x = (p.x < 0) ? 0 : (p.x > max_x ? max_x : p.x);
+    return p;
+}
+
+/**
+ * @inheritDoc
+ */
+int fc_write(FileContents * fc, int fd, Codec codec, bool bom, bool crlf, long * progress) {
+    CodecWriter * w = codec_open_write(fd, codec);
+    if (w == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    if (bom) {
+        result = codec_write(w, "\xef\xbb\xbf", 3);
+    }
+    for (int i = 0; i < fc->len && result == 0; i += 1) {
+        FileLine * line = fc->data[i];
+        if (crlf && line->len >= 2 && line->data[line->len - 2] == '\n') {
+            result = codec_write(w, line->data, line->len - 2);
+            result = (result == 0) ? codec_write(w, "\r\n", 2) : result;
+        } else {
+            result = codec_write(w, line->data, line->len - 1);
+        }
+        if (progress != NULL) {
+            __atomic_store_n(progress, i + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    int errsv = errno;
+    if (codec_close_write(w) == -1 && result == 0) {
+        result = -1;
+        errsv = errno;
+    }
+    errno = errsv;
+    return result;
+}
+
+/**
+ * Work out how much memory malloc really uses for an allocation
+ *
+ * @param size the number of bytes asked for
+ * @return the size of the chunk (a size word, rounded up to 16 bytes, at least 32)
+ */
+static size_t malloc_bytes(size_t size) {
+    size_t chunk = (size + sizeof(size_t) + 15) & ~(size_t) 15;
+    return (chunk < 32) ? 32 : chunk;
+}
+
+/**
+ * @inheritDoc
+ */
+size_t fl_bytes(int len) {
+    return malloc_bytes(sizeof(FileLine)) + malloc_bytes(len) + sizeof(FileLine *);
+}
+
+/**
+ * @inheritDoc
+ */
+size_t fc_bytes(FileContents * fc) {
+    size_t total = malloc_bytes(sizeof(FileContents)) + malloc_bytes(0);
+    for (int i = 0; i < fc->len; i += 1) {
+        total += fl_bytes(fc->data[i]->len);
+    }
+    return total;
+}
+
+#ifdef DELTA_CHECK
+/**
+ * @inheritDoc
+ */
+void fc_check(FileContents * fc, CursorList * cl) {
+    assert(fc != NULL && fc->len >= 1 && fc->data != NULL);
+
+    for (int i = 0; i < fc->len; i += 1) {
+        FileLine * line = fc->data[i];
+        assert(line != NULL && line->data != NULL);
+        assert(line->refs >= 1 && line->len >= 1);
+        assert(line->data[line->len - 1] == '\0');
+
+        char * nl = memchr(line->data, '\n', line->len - 1);
+        if (i < fc->len - 1) {
+            assert(nl == line->data + line->len - 2);
+        } else {
+            assert(nl == NULL || nl == line->data + line->len - 2);
+        }
+    }
+
+    for (int i = 0; cl->len > 1 && i < cl->len; i += 1) {
+        CursorPos p = cl->data[i];
+        assert(0 <= p.y && p.y < fc->len);
+        assert(0 <= p.x && p.x < fc->data[p.y]->len);
+        assert(i == 0 || cursor_cmp(&cl->data[i - 1], &p) < 0);
+    }
+}
+
+#endif
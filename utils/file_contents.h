@@ -0,0 +1,273 @@
+/**
+ * file_contents.h
+ *
+ * The document being edited: a table of lines, which can be shared between
+ * documents, the clipboard and saves, and are copied before they're changed.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#ifndef FILE_CONTENTS_LIB
+#define FILE_CONTENTS_LIB
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "codec.h"
+
+/**
+ * A position in a FileContents
+ */
+typedef struct {
+    int x;
+    int y;
+} CursorPos;
+
+/**
+ * A set of cursors, kept sorted by row and then column
+ */
+typedef struct {
+    CursorPos * data;
+    int len;
+    int cap;
+} CursorList;
+
+/**
+ * A line of the document, including its newline (the last line doesn't have one) and a nul-terminator
+ */
+typedef struct {
+    char * data;
+    int len;
+    int refs; // lines can be shared between documents, the clipboard and saves (only changed on the main thread)
+} FileLine;
+
+/**
+ * The lines of a document
+ */
+typedef struct {
+    FileLine ** data;
+    int len;
+} FileContents;
+
+/**
+ * Make a FileLine out of a run of characters
+ *
+ * @param head the start of the line that was left over from the previous block
+ * @param head_len the number of characters in head
+ * @param tail the rest of the line
+ * @param tail_len the number of characters in tail
+ * @return a pointer to the new FileLine
+ */
+FileLine * make_line(char * head, int head_len, char * tail, int tail_len);
+
+/**
+ * Take another reference to a FileLine
+ *
+ * @param line the FileLine to share
+ * @return the same FileLine
+ */
+FileLine * fl_share(FileLine * line);
+
+/**
+ * Drop a reference to a FileLine, freeing it once nothing uses it
+ *
+ * @param line the FileLine to release
+ */
+void fl_release(FileLine * line);
+
+/**
+ * Make sure nothing else is using a line before it gets changed (copy-on-write)
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param y the y coordinate of the line (aka row)
+ * @return the FileLine, which is now only used by fc
+ */
+FileLine * fc_own(FileContents * fc, int y);
+
+/**
+ * Swap in new storage for a line, giving it a FileLine of its own if it's shared
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param y the y coordinate of the line (aka row)
+ * @param data the new characters (nul-terminated), which fc takes ownership of
+ * @param len the length of data, including the nul-terminator
+ */
+void fc_replace(FileContents * fc, int y, char * data, int len);
+
+/**
+ * Add a FileLine onto the end of a FileContents
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param cap the number of lines fc->data has room for, updated when it grows
+ * @param entry the FileLine to add
+ */
+void fc_append(FileContents * fc, int * cap, FileLine * entry);
+
+/**
+ * Clean up a FileContents instance
+ *
+ * @param fc a pointer to the FileContents instance (given by read_file())
+ */
+void fc_cleanup(FileContents * fc);
+
+/**
+ * Insert a character at a certain position
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param x the x coordinate of the position (aka column)
+ * @param y the y coordinate of the position (aka row)
+ * @param ins_char the character to insert
+ */
+void fc_insert(FileContents * fc, int x, int y, char ins_char);
+
+/**
+ * Remove a character at a certain position
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param x the x coordinate of the position (aka column)
+ * @param y the y coordinate of the position (aka row)
+ */
+void fc_remove(FileContents * fc, int x, int y);
+
+/**
+ * Make a new line, splitting a line in two at a certain position
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param x the x coordinate of the position (aka column)
+ * @param y the y coordinate of the position (aka row)
+ */
+void fc_newline(FileContents * fc, int x, int y);
+
+/**
+ * Insert a character at every cursor in one pass
+ *
+ * Each line with cursors on it is rebuilt once, with all of its insertions,
+ * and the cursors are moved along as the line is copied.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param curs the cursors, sorted by row and then column
+ * @param n the number of cursors
+ * @param ins_char the character to insert
+ * @param first set to the first row that changed
+ * @param last set to the last row that changed
+ */
+void fc_insert_batch(FileContents * fc, CursorPos * curs, int n, char ins_char, int * first, int * last);
+
+/**
+ * Remove a character at (or just before) every cursor in one pass
+ *
+ * Cursors never join lines here, so a backspace at the start of a line or a
+ * delete on a newline is skipped for that cursor.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param curs the cursors, sorted by row and then column
+ * @param n the number of cursors
+ * @param before true to remove the character before the cursor (backspace)
+ * @param first set to the first row that changed
+ * @param last set to the last row that changed
+ */
+void fc_remove_batch(FileContents * fc, CursorPos * curs, int n, bool before, int * first, int * last);
+
+/**
+ * Copy a region of a FileContents
+ *
+ * Whole lines in the middle of the region are shared rather than copied, so
+ * this costs O(lines) no matter how many bytes are in the region.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param start the first position of the region
+ * @param end the position just after the region
+ * @return a FileContents holding the region (the last line has no newline)
+ *
+ * @note the returned object must be freed using fc_cleanup
+ */
+FileContents * fc_copy(FileContents * fc, CursorPos start, CursorPos end);
+
+/**
+ * Remove a region of a FileContents
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param start the first position of the region
+ * @param end the position just after the region
+ */
+void fc_delete_range(FileContents * fc, CursorPos start, CursorPos end);
+
+/**
+ * Paste a copied region into a FileContents
+ *
+ * The lines in the middle of the region are shared with the clipboard, so
+ * only the two lines at the edges get their bytes copied.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param at the position to paste at, moved to the end of the pasted text
+ * @param clip the region (given by fc_copy())
+ */
+void fc_paste(FileContents * fc, CursorPos * at, FileContents * clip);
+
+/**
+ * Order cursors by row, and then by column
+ *
+ * @param a a pointer to the first CursorPos
+ * @param b a pointer to the second CursorPos
+ * @return less than, equal to, or greater than zero, like strcmp
+ */
+int cursor_cmp(const void * a, const void * b);
+
+/**
+ * Put a position back inside the FileContents
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param p the position to fix
+ * @return the closest position that exists
+ */
+CursorPos clamp_pos(FileContents * fc, CursorPos p);
+
+/**
+ * Write the lines of a FileContents into a file, the way the file was read
+ * (compression, line endings and byte order mark)
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param fd the file to write into, which gets closed
+ * @param codec the compression format to use
+ * @param bom true to start the file with a UTF-8 byte order mark
+ * @param crlf true to end the lines with "\r\n" instead of "\n"
+ * @param progress set to the number of lines written so far as the write goes (may be NULL)
+ * @return 0 on success, otherwise -1 with errno set
+ *
+ * @note only reads fc, so it's safe to call from a background thread on a snapshot
+ */
+int fc_write(FileContents * fc, int fd, Codec codec, bool bom, bool crlf, long * progress);
+
+/**
+ * Count the bytes of memory one line takes up: its FileLine, its characters
+ * and its slot in the FileContents, with what malloc adds to each
+ *
+ * @param len the length of the line, including the nul-terminator
+ * @return the approximate number of bytes
+ */
+size_t fl_bytes(int len);
+
+/**
+ * Count the bytes of memory a FileContents is using
+ *
+ * @param fc a pointer to the FileContents instance
+ * @return the approximate number of bytes
+ */
+size_t fc_bytes(FileContents * fc);
+
+#ifdef DELTA_CHECK
+/**
+ * Check that a FileContents is well formed, aborting if it isn't
+ *
+ * Every line has to end with a '\0' and have exactly one '\n', just before it.
+ * The last line is allowed to go without one.
+ *
+ * @param fc a pointer to the FileContents instance
+ * @param cl the cursors, which all have to be somewhere in the text (when there's more than one)
+ *
+ * @note only built with -DDELTA_CHECK (see make sanitize and make check)
+ */
+void fc_check(FileContents * fc, CursorList * cl);
+
+#endif
+
+#endif
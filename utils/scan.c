@@ -0,0 +1,278 @@
+/**
+ * scan.c
+ *
+ * A quick look over a file before it gets opened, to find out how it's laid out.
+ * The file is mapped into memory and every thread takes a slice of it.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan.h"
+
+// Don't bother with another thread for less than this much of the file
+#define SCAN_MIN_SLICE (4 << 20)
+// Upper limit on the number of scanning threads
+#define SCAN_MAX_THREADS 16
+
+typedef struct {
+    const unsigned char * file;
+    size_t file_len;
+    size_t start;
+    size_t end;
+
+    long newlines;
+    long crlf;
+    long tab_indents;
+    long space_indents;
+    long indent_2;  // space indents that are a multiple of 2 but not 4
+    long indent_4;  // space indents that are a multiple of 4 but not 8
+    bool non_ascii;
+    bool invalid_utf8;
+} ScanSlice;
+
+/**
+ * Look at the indentation of the line starting at an offset
+ *
+ * @param s the slice the line belongs to
+ * @param at the offset of the start of the line
+ */
+static void scan_indent(ScanSlice * s, size_t at) {
+    if (at >= s->file_len) {
+        return;
+    }
+    if (s->file[at] == '\t') {
+        s->tab_indents += 1;
+        return;
+    }
+
+    size_t spaces = 0;
+    while (at + spaces < s->file_len && s->file[at + spaces] == ' ') {
+        spaces += 1;
+    }
+    if (spaces == 0 || at + spaces >= s->file_len || s->file[at + spaces] == '\n') {
+        return; // not indented, or a blank line
+    }
+
+    s->space_indents += 1;
+    if (spaces % 4 == 2) {
+        s->indent_2 += 1;
+    } else if (spaces % 8 == 4) {
+        s->indent_4 += 1;
+    }
+}
+
+/**
+ * Check the UTF-8 in a slice, skipping over plain ASCII a word at a time
+ *
+ * @param s the slice to check
+ */
+static void scan_utf8(ScanSlice * s) {
+    const unsigned char * file = s->file;
+    size_t i = s->start;
+
+    // A sequence that started in the previous slice is checked by that slice
+    while (i > 0 && i < s->end && (file[i] & 0xc0) == 0x80) {
+        i += 1;
+    }
+
+    while (i < s->end) {
+        if (i + 8 <= s->end) {
+            uint64_t word;
+            memcpy(&word, file + i, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char c = file[i];
+        if (c < 0x80) {
+            i += 1;
+            continue;
+        }
+        s->non_ascii = true;
+
+        // Work out how many continuation bytes should follow
+        size_t follow;
+        if (c >= 0xc2 && c <= 0xdf) {
+            follow = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            follow = 2;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            follow = 3;
+        } else {
+            s->invalid_utf8 = true;
+            return;
+        }
+
+        // The sequence is allowed to run into the next slice, but not off the end of the file
+        if (i + follow >= s->file_len) {
+            s->invalid_utf8 = true;
+            return;
+        }
+        for (size_t k = 1; k <= follow; k += 1) {
+            if ((file[i + k] & 0xc0) != 0x80) {
+                s->invalid_utf8 = true;
+                return;
+            }
+        }
+        i += follow + 1;
+    }
+}
+
+/**
+ * Scan one slice of the file
+ *
+ * @param arg a pointer to the ScanSlice to fill in
+ */
+static void * scan_slice(void * arg) {
+    ScanSlice * s = arg;
+    const unsigned char * file = s->file;
+
+    // Lines that start in this slice
+    if (s->start == 0) {
+        scan_indent(s, 0);
+    }
+
+    const unsigned char * cur = file + s->start;
+    const unsigned char * end = file + s->end;
+    const unsigned char * nl;
+    while ((nl = memchr(cur, '\n', end - cur)) != NULL) {
+        s->newlines += 1;
+        if (nl > file && nl[-1] == '\r') {
+            s->crlf += 1;
+        }
+        scan_indent(s, nl - file + 1);
+        cur = nl + 1;
+    }
+
+    scan_utf8(s);
+    return NULL;
+}
+
+/**
+ * @inheritDoc
+ */
+int scan_file(const char * path, ScanResult * result) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        return -1;
+    }
+    size_t len = info.st_size;
+
+    const unsigned char * file = NULL;
+    if (len > 0) {
+        file = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file == MAP_FAILED) {
+            int errsv = errno;
+            close(fd);
+            errno = errsv;
+            return -1;
+        }
+    }
+    close(fd);
+
+    // Split the file between the threads
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = (cpus < 1) ? 1 : (size_t) cpus;
+    threads = (threads > SCAN_MAX_THREADS) ? SCAN_MAX_THREADS : threads;
+    if (len / SCAN_MIN_SLICE + 1 < threads) {
+        threads = len / SCAN_MIN_SLICE + 1;
+    }
+
+    ScanSlice slices[SCAN_MAX_THREADS];
+    pthread_t tids[SCAN_MAX_THREADS];
+    bool started[SCAN_MAX_THREADS];
+    for (size_t i = 0; i < threads; i += 1) {
+        memset(&slices[i], 0, sizeof(ScanSlice));
+        slices[i].file = file;
+        slices[i].file_len = len;
+        slices[i].start = len / threads * i;
+        slices[i].end = (i == threads - 1) ? len : len / threads * (i + 1);
+    }
+
+    // Hand all but the first slice to worker threads, and do the first one here
+    for (size_t i = 1; i < threads; i += 1) {
+        started[i] = (pthread_create(&tids[i], NULL, scan_slice, &slices[i]) == 0);
+        if (!started[i]) {
+            scan_slice(&slices[i]);
+        }
+    }
+    if (len > 0) {
+        scan_slice(&slices[0]);
+    }
+
+    // Add up what the slices found
+    memset(result, 0, sizeof(ScanResult));
+    long indent_2 = 0;
+    long indent_4 = 0;
+    bool non_ascii = false;
+    bool invalid_utf8 = false;
+    for (size_t i = 0; i < threads; i += 1) {
+        if (i > 0 && started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        result->lines += slices[i].newlines;
+        result->crlf += slices[i].crlf;
+        result->tab_indents += slices[i].tab_indents;
+        result->space_indents += slices[i].space_indents;
+        indent_2 += slices[i].indent_2;
+        indent_4 += slices[i].indent_4;
+        non_ascii = non_ascii || slices[i].non_ascii;
+        invalid_utf8 = invalid_utf8 || slices[i].invalid_utf8;
+    }
+
+    // The file has one more line than it has newlines
+    long newlines = result->lines;
+    result->lines += 1;
+
+    if (result->crlf == 0) {
+        result->eol = EOL_LF;
+    } else if (result->crlf == newlines) {
+        result->eol = EOL_CRLF;
+    } else {
+        result->eol = EOL_MIXED;
+    }
+
+    if (len >= 3 && file[0] == 0xef && file[1] == 0xbb && file[2] == 0xbf) {
+        result->encoding = invalid_utf8 ? ENC_LATIN1 : ENC_UTF8_BOM;
+    } else if (invalid_utf8) {
+        result->encoding = ENC_LATIN1;
+    } else {
+        result->encoding = non_ascii ? ENC_UTF8 : ENC_ASCII;
+    }
+
+    // Odd multiples of 2 mean 2-space indents, odd multiples of 4 mean 4 (or 2)
+    if (indent_2 * 10 > result->space_indents) {
+        result->indent_width = 2;
+    } else if (indent_4 * 10 > result->space_indents || result->space_indents == 0) {
+        result->indent_width = 4;
+    } else {
+        result->indent_width = 8;
+    }
+
+    if (file != NULL) {
+        munmap((void *) file, len);
+    }
+    return 0;
+}
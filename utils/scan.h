@@ -0,0 +1,52 @@
+/**
+ * scan.h
+ *
+ * A quick look over a file before it gets opened, to find out how it's laid out.
+ *
+ * @author Connor Henley, @thatging3rkid
+ */
+#ifndef SCAN_LIB
+#define SCAN_LIB
+
+/**
+ * The kind of line endings in a file
+ */
+typedef enum {
+    EOL_LF,
+    EOL_CRLF,
+    EOL_MIXED
+} LineEnding;
+
+/**
+ * The character encoding of a file
+ */
+typedef enum {
+    ENC_ASCII,
+    ENC_UTF8,
+    ENC_UTF8_BOM,
+    ENC_LATIN1
+} Encoding;
+
+/**
+ * What a scan found out about a file
+ */
+typedef struct {
+    long lines;          // the number of lines (one more than the number of newlines)
+    long crlf;           // the number of newlines with a carriage return before them
+    LineEnding eol;
+    Encoding encoding;
+    long tab_indents;    // the number of lines indented with a tab
+    long space_indents;  // the number of lines indented with spaces
+    int indent_width;    // the most likely width of one level of space indentation
+} ScanResult;
+
+/**
+ * Scan a file, splitting the work between a thread for each processor
+ *
+ * @param path the location of the file
+ * @param result where to put what was found
+ * @return 0 on success, otherwise -1 with errno set
+ */
+int scan_file(const char * path, ScanResult * result);
+
+#endif
@@ -14,20 +14,20 @@
  * @inheritDoc
  */
 char * str_trim(char * string) {
-    int final_len = strlen(string);
-    int i = 0;
-    const int len = strlen(string);
+    const size_t len = strlen(string);
+    size_t i = 0;
 
     // Make sure the string is long enough
     if (len == 0) {
         char * output = malloc(sizeof(char));
         output[0] = '\0';
+        free(string);
         return output;
     }
     
     if (len == 1) {
         char * output;
-        if (string[0] != ' ') {
+        if (string[0] != ' ' && string[0] != '\t') {
             output = malloc(sizeof(char) * 2);
             output[0] = string[0];
             output[1] = '\0';
@@ -40,30 +40,21 @@ char * str_trim(char * string) {
     }
 
     // Start from the front
-    while (true) {
-        if (string[i] != ' ') {
-            break;
-        } else {
-            final_len -= 1;
-            i += 1;
-        }
+    while (i < len && (string[i] == ' ' || string[i] == '\t')) {
+        i += 1;
     }
 
-    // Then go to the back
-    int k = len - 1;
-    while (true) {
-        if (string[k] != ' ') {
-            break;
-        } else {
-            final_len -= 1;
-            k -= 1;
-        }
+    // Then go to the back (stopping at the front, for a string that's all spaces)
+    size_t k = len;
+    while (k > i && (string[k - 1] == ' ' || string[k - 1] == '\t')) {
+        k -= 1;
     }
 
-    // Then copy the values out of the middle into the new array
+    // Then copy the values out of the middle into the new array (k never goes below i)
+    size_t final_len = k - i;
     char * output = malloc(sizeof(char) * (final_len + 1));
     
-    for (int l = 0; l < final_len; l += 1) {
+    for (size_t l = 0; l < final_len; l += 1) {
         output[l] = string[l + i];
     }
 
@@ -107,3 +98,32 @@ int str_guessbase(char * input) {
         return 10;
     }
 }
+
+/**
+ * @inheritDoc
+ */
+char * str_base64(char * input, int len) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char * output = malloc(sizeof(char) * (((len + 2) / 3) * 4 + 1));
+    int out = 0;
+
+    // Every 3 bytes become 4 characters
+    for (int i = 0; i < len; i += 3) {
+        unsigned int chunk = (unsigned char) input[i] << 16;
+        if (i + 1 < len) {
+            chunk |= (unsigned char) input[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            chunk |= (unsigned char) input[i + 2];
+        }
+
+        output[out] = alphabet[(chunk >> 18) & 0x3f];
+        output[out + 1] = alphabet[(chunk >> 12) & 0x3f];
+        output[out + 2] = (i + 1 < len) ? alphabet[(chunk >> 6) & 0x3f] : '=';
+        output[out + 3] = (i + 2 < len) ? alphabet[chunk & 0x3f] : '=';
+        out += 4;
+    }
+
+    output[out] = '\0';
+    return output;
+}
@@ -17,9 +17,9 @@ typedef struct {
 } String;
 
 /**
- * Trim the spaces from a string
+ * Trim the spaces (and tabs) from a string
  *
- * @param string the raw string
+ * @param string the raw string, which is freed
  * @return a string without any spaces beginning or trailing the string
  *
  * @note nul-terminated strings are used
@@ -45,4 +45,15 @@ char * str_parse(char * input);
  */
 int str_guessbase(char * input);
 
+/**
+ * Encode some bytes in base64
+ *
+ * @param input the bytes to encode
+ * @param len the number of bytes in input
+ * @return the encoded string
+ *
+ * @note the returned string must be freed
+ */
+char * str_base64(char * input, int len);
+
 #endif